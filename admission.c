@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "safeUtil.h"
+#include "admission.h"
+
+static int  findWaiter(Admission *ac, struct sockaddr_in6 *client, uint32_t nonce);
+static void removeWaiter(Admission *ac, int index);
+static void expireWaiters(Admission *ac);
+static void heldFor(Admission *ac, int ahead, int *sessions, uint64_t *bytes);
+static bool hasRoom(Admission *ac, int heldSessions, uint64_t bytes, bool windowFits);
+static uint32_t grantWindow(Admission *ac, uint32_t requested, uint32_t bufSize);
+static uint64_t paneCost(uint32_t bufSize);
+
+void initAdmission(Admission *ac, int maxSessions, uint64_t maxBytes, uint64_t memBudget, int queueCap){
+    memset(ac, 0, sizeof(Admission));
+    ac->maxSessions = maxSessions;
+    ac->maxBytes = maxBytes;
+    ac->memBudget = memBudget;
+    ac->queueCap = queueCap;
+    ac->queue = sCalloc(queueCap > 0 ? queueCap : 1, sizeof(AdmissionWaiter));
+    pthread_mutex_init(&ac->lock, NULL);
+}
+
+int admitClient(Admission *ac, ChildContext *child, int replySocket){
+    uint32_t retryMs = 0;
+
+    pthread_mutex_lock(&ac->lock);
+    expireWaiters(ac);
+    uint32_t window = grantWindow(ac, child->winSize, child->bufSize);
+    uint64_t bytes = (uint64_t)window * child->bufSize;
+    bool windowFits = window >= (child->winSize < WINDOW_MIN_GRANT ? child->winSize : WINDOW_MIN_GRANT);
+
+    // Clients already waiting go first: capacity is held for those queued
+    // ahead that still come back on time, and whatever is left over is
+    // this client's, so freed capacity admits as many as it fits.
+    int position = findWaiter(ac, &child->client, child->nonce);
+    int heldSessions;
+    uint64_t heldBytes;
+    heldFor(ac, position >= 0 ? position : ac->queueLen, &heldSessions, &heldBytes);
+
+    if (hasRoom(ac, heldSessions, heldBytes + bytes, windowFits)) {
+        if (position >= 0) {
+            removeWaiter(ac, position);
+        }
+        if (window < child->winSize) {
+            printf("Window for %s clamped by memory budget: %u -> %u\n", child->filename, child->winSize, window);
+        }
+        child->winSize = window;
+        child->admitted = true;
+        child->admittedBytes = bytes;
+        child->admittedMem = (uint64_t)window * paneCost(child->bufSize);
+        ac->activeSessions++;
+        ac->bytesInFlight += bytes;
+        ac->memInUse += child->admittedMem;
+    } else {
+        // Clients without a nonce can't be recognised on retry, so they are not queued
+        if (position < 0 && child->nonce != 0 && ac->queueLen < ac->queueCap) {
+            position = ac->queueLen++;
+            ac->queue[position].client = child->client;
+            ac->queue[position].nonce = child->nonce;
+        }
+        if (position >= 0) {
+            ac->queue[position].bytes = bytes;
+        }
+
+        if (position < 0) {
+            retryMs = ADMIT_RETRY_MAX_MS;   // queue full, come back much later
+        } else {
+            retryMs = ADMIT_RETRY_MS * (position + 1);
+            if (retryMs > ADMIT_RETRY_MAX_MS) {
+                retryMs = ADMIT_RETRY_MAX_MS;
+            }
+            ac->queue[position].retryAt = getTimeMs() + retryMs;
+            ac->queue[position].expires = ac->queue[position].retryAt + ADMIT_GRACE_MS;
+        }
+    }
+    int active = ac->activeSessions;
+    pthread_mutex_unlock(&ac->lock);
+
+    if (retryMs == 0) {
+        printf("Admitted %s (%llu bytes in flight): %d active\n",
+               child->filename, (unsigned long long)bytes, active);
+        return 0;
+    }
+    printf("Server busy (%d active), %s told to retry in %u ms\n", active, child->filename, retryMs);
+    sendBusyAck(replySocket, &child->client, retryMs);
+    return -1;
+}
+
+void releaseClient(Admission *ac, ChildContext *child){
+    if (!child->admitted) {
+        return;
+    }
+    releaseReservation(ac, child->admittedBytes, child->admittedMem);
+    child->admitted = false;
+    child->admittedBytes = 0;
+    child->admittedMem = 0;
+}
+
+void releaseReservation(Admission *ac, uint64_t bytes, uint64_t mem){
+    pthread_mutex_lock(&ac->lock);
+    ac->activeSessions--;
+    ac->bytesInFlight -= bytes;
+    ac->memInUse -= mem;
+    pthread_mutex_unlock(&ac->lock);
+}
+
+uint32_t fairWindow(Admission *ac, uint32_t bufSize){
+    uint32_t window = 0;
+    pthread_mutex_lock(&ac->lock);
+    bool pressure = ac->queueLen > 0 || ac->memInUse * 100 > ac->memBudget * WINDOW_PRESSURE_PCT;
+    if (ac->memBudget > 0 && paneCost(bufSize) > 0 && ac->activeSessions > 0 && pressure) {
+        uint64_t share = ac->memBudget / (ac->activeSessions + ac->queueLen) / paneCost(bufSize);
+        window = share < WINDOW_MIN_GRANT ? WINDOW_MIN_GRANT : (uint32_t)share;
+    }
+    pthread_mutex_unlock(&ac->lock);
+    return window;
+}
+
+void shrinkGrant(Admission *ac, ChildContext *child){
+    uint64_t mem = (uint64_t)child->wb.window_size * paneCost(child->bufSize);
+    if (!child->admitted || mem >= child->admittedMem) {
+        return;
+    }
+    uint64_t bytes = (uint64_t)child->wb.window_size * child->bufSize;
+
+    pthread_mutex_lock(&ac->lock);
+    ac->memInUse -= child->admittedMem - mem;
+    ac->bytesInFlight -= child->admittedBytes - bytes;
+    pthread_mutex_unlock(&ac->lock);
+    child->admittedMem = mem;
+    child->admittedBytes = bytes;
+}
+
+// Largest window up to the request that fits both the free budget and an
+// even share of it among the sessions already running.
+static uint32_t grantWindow(Admission *ac, uint32_t requested, uint32_t bufSize){
+    if (ac->memBudget == 0 || paneCost(bufSize) == 0) {
+        return requested;
+    }
+    uint64_t freeMem = ac->memBudget > ac->memInUse ? ac->memBudget - ac->memInUse : 0;
+    uint64_t share = ac->memBudget / (ac->activeSessions + 1);
+    uint64_t limit = (freeMem < share ? freeMem : share) / paneCost(bufSize);
+    return requested > limit ? (uint32_t)limit : requested;
+}
+
+// Window memory per packet of bufSize bytes. Mapped and cached sessions keep
+// no window copy; the cache has its own bound.
+static uint64_t paneCost(uint32_t bufSize){
+    return sessionsUsePanes() ? sizeof(pane) + PANE_BYTES(bufSize) : 0;
+}
+
+// Sessions and bytes to keep free for the first ahead waiters. One that
+// has missed its retry by ADMIT_LATE_MS keeps its place until it expires,
+// but doesn't hold back the clients behind it meanwhile.
+static void heldFor(Admission *ac, int ahead, int *sessions, uint64_t *bytes){
+    uint64_t now = getTimeMs();
+    *sessions = 0;
+    *bytes = 0;
+    for (int i = 0; i < ahead; i++) {
+        if (ac->queue[i].retryAt + ADMIT_LATE_MS >= now) {
+            (*sessions)++;
+            *bytes += ac->queue[i].bytes;
+        }
+    }
+}
+
+// A single session larger than the whole byte budget is still admitted on
+// an otherwise idle server, so it can never be starved outright. bytes
+// includes what heldSessions waiters ahead of it will need.
+static bool hasRoom(Admission *ac, int heldSessions, uint64_t bytes, bool windowFits){
+    int sessions = ac->activeSessions + heldSessions;
+    if (ac->maxSessions > 0 && sessions >= ac->maxSessions) {
+        return false;
+    }
+    if (ac->maxBytes > 0 && sessions > 0 && ac->bytesInFlight + bytes > ac->maxBytes) {
+        return false;
+    }
+    if (!windowFits) {
+        return false;   // budget exhausted, wait for windows to shrink or end
+    }
+    return true;
+}
+
+static int findWaiter(Admission *ac, struct sockaddr_in6 *client, uint32_t nonce){
+    for (int i = 0; i < ac->queueLen; i++) {
+        if (sameHandshake(&ac->queue[i].client, ac->queue[i].nonce, client, nonce)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void removeWaiter(Admission *ac, int index){
+    memmove(&ac->queue[index], &ac->queue[index + 1],
+            (ac->queueLen - index - 1) * sizeof(AdmissionWaiter));
+    ac->queueLen--;
+}
+
+static void expireWaiters(Admission *ac){
+    uint64_t now = getTimeMs();
+    int i = 0;
+    while (i < ac->queueLen) {
+        if (ac->queue[i].expires <= now) {
+            removeWaiter(ac, i);
+        } else {
+            i++;
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "session.h"
+
+#define ADMIT_DEFAULT_QUEUE 32
+#define ADMIT_RETRY_MS 250          // retry hint per queue position
+#define ADMIT_RETRY_MAX_MS 5000
+#define ADMIT_GRACE_MS 2000         // a waiter that misses its retry by this much loses its place
+#define ADMIT_LATE_MS 250           // one this late no longer holds capacity for itself
+
+#define WINDOW_DEFAULT_BUDGET (256ULL << 20)   // bytes of window panes across all sessions
+#define WINDOW_MIN_GRANT 4          // smallest window worth admitting a session with
+#define WINDOW_PRESSURE_PCT 90      // budget use above which windows shrink to a fair share
+
+// A client told to come back later, remembered so it keeps its place.
+typedef struct {
+    struct sockaddr_in6 client;
+    uint32_t nonce;
+    uint64_t bytes;     // window * buffer it asked for
+    uint64_t retryAt;   // when it was told to come back
+    uint64_t expires;
+} AdmissionWaiter;
+
+// Server-wide limits on concurrent sessions, on the bytes they may have in
+// flight (window * buffer) and on the memory their window buffers take
+// (window * sizeof(pane)). All three are reserved when a session is
+// admitted. Shared by every front end; the lock only matters in threaded mode.
+typedef struct {
+    int maxSessions;           // 0 = unlimited
+    uint64_t maxBytes;         // 0 = unlimited
+    uint64_t memBudget;        // 0 = unlimited
+    int activeSessions;
+    uint64_t bytesInFlight;
+    uint64_t memInUse;
+
+    AdmissionWaiter *queue;    // FIFO of busy clients
+    int queueLen;
+    int queueCap;
+    pthread_mutex_t lock;
+} Admission;
+
+void initAdmission(Admission *ac, int maxSessions, uint64_t maxBytes, uint64_t memBudget, int queueCap);
+
+// Admits the session or answers the client with a "Busy" ACK from
+// replySocket. An admitted session's child->winSize is clamped to what the
+// memory budget can grant. Returns 0 when admitted.
+int admitClient(Admission *ac, ChildContext *child, int replySocket);
+
+// Window, in packets of bufSize bytes, every session should fit in while the
+// memory budget is under pressure, or 0 when there is no pressure.
+uint32_t fairWindow(Admission *ac, uint32_t bufSize);
+
+// Gives back the part of a session's reservation its window no longer uses
+// after limitSessionWindow() shrank it.
+void shrinkGrant(Admission *ac, ChildContext *child);
+
+// Returns an admitted session's reservation. Safe to call on sessions that
+// were never admitted.
+void releaseClient(Admission *ac, ChildContext *child);
+
+// Releases a reservation by size, for front ends that no longer hold the context.
+void releaseReservation(Admission *ac, uint64_t bytes, uint64_t mem);
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "safeUtil.h"
+#include "blockCache.h"
+
+static bool sameVersion(const FileVersion *a, const FileVersion *b);
+static bool sameFile(const FileVersion *a, const FileVersion *b);
+static unsigned bucketOf(const FileVersion *version, uint32_t bufSize, uint64_t index);
+static CacheBlock *lookupBlock(BlockCache *cache, const FileVersion *version, uint32_t bufSize, uint64_t index);
+static void lruPushHead(BlockCache *cache, CacheBlock *block);
+static void lruRemove(BlockCache *cache, CacheBlock *block);
+static void unlinkBlock(BlockCache *cache, CacheBlock *block);
+static void freeBlock(CacheBlock *block);
+static void evictBlocks(BlockCache *cache);
+static ssize_t readBlock(int fd, uint8_t *data, uint32_t len, off_t offset);
+
+void initBlockCache(BlockCache *cache, uint64_t capacity){
+    memset(cache, 0, sizeof(BlockCache));
+    cache->capacity = capacity;
+    cache->fileCap = CACHE_FILE_TABLE_SIZE;
+    cache->files = sCalloc(cache->fileCap, sizeof(FileVersion));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+}
+
+void checkFileVersion(BlockCache *cache, const FileVersion *version){
+    pthread_mutex_lock(&cache->lock);
+    int i;
+    for (i = 0; i < cache->fileCount; i++) {
+        if (sameFile(&cache->files[i], version)) {
+            break;
+        }
+    }
+
+    if (i == cache->fileCount) {
+        if (cache->fileCount == cache->fileCap) {
+            cache->fileCap *= 2;
+            cache->files = srealloc(cache->files, cache->fileCap * sizeof(FileVersion));
+        }
+        cache->fileCount++;
+    } else if (!sameVersion(&cache->files[i], version)) {
+        // The file changed under us: drop every block of its older versions
+        int dropped = 0;
+        for (int b = 0; b < CACHE_BUCKETS; b++) {
+            CacheBlock *block = cache->buckets[b];
+            while (block) {
+                CacheBlock *next = block->hashNext;
+                if (sameFile(&block->version, version) && !sameVersion(&block->version, version)) {
+                    unlinkBlock(cache, block);
+                    if (block->refs == 0) {
+                        freeBlock(block);
+                    }
+                    dropped++;
+                }
+                block = next;
+            }
+        }
+        printf("Cache: file changed (size %lld), dropped %d blocks\n", (long long)version->size, dropped);
+    }
+    cache->files[i] = *version;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+CacheBlock *acquireBlock(BlockCache *cache, const FileVersion *version, int fd,
+                         uint32_t bufSize, uint64_t index){
+    pthread_mutex_lock(&cache->lock);
+    CacheBlock *block = lookupBlock(cache, version, bufSize, index);
+    if (block) {
+        block->refs++;
+        while (block->loading) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);   // single-flight
+        }
+        if (block->failed) {
+            if (--block->refs == 0) {
+                freeBlock(block);
+            }
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        cache->hits++;
+        lruRemove(cache, block);
+        lruPushHead(cache, block);
+        pthread_mutex_unlock(&cache->lock);
+        return block;
+    }
+
+    // Miss: publish a loading block first so concurrent readers wait on it
+    // instead of reading the same block again.
+    cache->misses++;
+    block = sCalloc(1, sizeof(CacheBlock));
+    block->version = *version;
+    block->bufSize = bufSize;
+    block->index = index;
+    block->data = sCalloc(1, bufSize);
+    block->refs = 1;
+    block->loading = true;
+
+    unsigned bucket = bucketOf(version, bufSize, index);
+    block->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = block;
+    lruPushHead(cache, block);
+    cache->used += bufSize;
+    evictBlocks(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    ssize_t got = readBlock(fd, block->data, bufSize, (off_t)index * bufSize);
+
+    pthread_mutex_lock(&cache->lock);
+    block->loading = false;
+    if (got < 0) {
+        block->failed = true;
+        unlinkBlock(cache, block);   // the next reader retries from disk
+    } else {
+        block->len = (uint32_t)got;
+    }
+    pthread_cond_broadcast(&cache->loaded);
+
+    if (block->failed) {
+        if (--block->refs == 0) {
+            freeBlock(block);
+        }
+        block = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return block;
+}
+
+void releaseBlock(BlockCache *cache, CacheBlock *block){
+    pthread_mutex_lock(&cache->lock);
+    if (--block->refs == 0) {
+        if (block->stale) {
+            freeBlock(block);
+        } else if (cache->used > cache->capacity) {
+            evictBlocks(cache);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void printCacheStats(BlockCache *cache){
+    pthread_mutex_lock(&cache->lock);
+    printf("Cache: %llu hits, %llu misses, %llu of %llu bytes used\n",
+           (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+           (unsigned long long)cache->used, (unsigned long long)cache->capacity);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void freeBlockCache(BlockCache *cache){
+    printCacheStats(cache);
+    for (int b = 0; b < CACHE_BUCKETS; b++) {
+        CacheBlock *block = cache->buckets[b];
+        while (block) {
+            CacheBlock *next = block->hashNext;
+            freeBlock(block);
+            block = next;
+        }
+    }
+    free(cache->files);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+}
+
+// Drops least recently used blocks until the cache fits its capacity.
+// Pinned and loading blocks are skipped, so the cache can run over its
+// capacity while every block is in some session's window.
+static void evictBlocks(BlockCache *cache){
+    CacheBlock *block = cache->lruTail;
+    while (block && cache->used > cache->capacity) {
+        CacheBlock *prev = block->lruPrev;
+        if (block->refs == 0 && !block->loading) {
+            unlinkBlock(cache, block);
+            freeBlock(block);
+        }
+        block = prev;
+    }
+}
+
+static CacheBlock *lookupBlock(BlockCache *cache, const FileVersion *version, uint32_t bufSize, uint64_t index){
+    CacheBlock *block = cache->buckets[bucketOf(version, bufSize, index)];
+    while (block) {
+        if (block->index == index && block->bufSize == bufSize && sameVersion(&block->version, version)) {
+            return block;
+        }
+        block = block->hashNext;
+    }
+    return NULL;
+}
+
+// Takes a block out of the hash and the LRU list. It is freed by the caller
+// or, if still pinned, by the last releaseBlock().
+static void unlinkBlock(BlockCache *cache, CacheBlock *block){
+    CacheBlock **link = &cache->buckets[bucketOf(&block->version, block->bufSize, block->index)];
+    while (*link && *link != block) {
+        link = &(*link)->hashNext;
+    }
+    if (*link) {
+        *link = block->hashNext;
+    }
+    lruRemove(cache, block);
+    cache->used -= block->bufSize;
+    block->stale = true;
+}
+
+static void lruPushHead(BlockCache *cache, CacheBlock *block){
+    block->lruPrev = NULL;
+    block->lruNext = cache->lruHead;
+    if (cache->lruHead) {
+        cache->lruHead->lruPrev = block;
+    }
+    cache->lruHead = block;
+    if (cache->lruTail == NULL) {
+        cache->lruTail = block;
+    }
+}
+
+static void lruRemove(BlockCache *cache, CacheBlock *block){
+    if (block->lruPrev) {
+        block->lruPrev->lruNext = block->lruNext;
+    } else {
+        cache->lruHead = block->lruNext;
+    }
+    if (block->lruNext) {
+        block->lruNext->lruPrev = block->lruPrev;
+    } else {
+        cache->lruTail = block->lruPrev;
+    }
+    block->lruPrev = NULL;
+    block->lruNext = NULL;
+}
+
+static void freeBlock(CacheBlock *block){
+    free(block->data);
+    free(block);
+}
+
+static ssize_t readBlock(int fd, uint8_t *data, uint32_t len, off_t offset){
+    uint32_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, data + got, len - got, offset + got);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            return -1;
+        }
+        if (n == 0) {
+            break;   // end of file
+        }
+        got += n;
+    }
+    return got;
+}
+
+static bool sameFile(const FileVersion *a, const FileVersion *b){
+    return a->dev == b->dev && a->ino == b->ino;
+}
+
+static bool sameVersion(const FileVersion *a, const FileVersion *b){
+    return sameFile(a, b) && a->size == b->size
+        && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static unsigned bucketOf(const FileVersion *version, uint32_t bufSize, uint64_t index){
+    uint64_t h = (uint64_t)version->ino * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)version->dev + ((uint64_t)bufSize << 32) + index;
+    h *= 0xC2B2AE3D27D4EB4FULL;
+    return (unsigned)(h >> 32) % CACHE_BUCKETS;
+}
@@ -0,0 +1,76 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define CACHE_DEFAULT_BYTES (64ULL << 20)
+#define CACHE_BUCKETS 4096
+#define CACHE_FILE_TABLE_SIZE 16
+
+// Identity of one version of a file. Blocks are keyed by it, so a file that
+// changes size or mtime never serves its old blocks.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} FileVersion;
+
+typedef struct CacheBlock {
+    FileVersion version;
+    uint32_t bufSize;          // sessions with different buffer sizes don't share blocks
+    uint64_t index;            // block number: file offset / bufSize
+    uint8_t *data;
+    uint32_t len;              // short only for the last block of the file
+    int refs;                  // pins held by sessions, pinned blocks are never evicted
+    bool loading;              // single-flight: the first reader is filling it
+    bool failed;
+    bool stale;                // file changed, free on last release
+    struct CacheBlock *hashNext;
+    struct CacheBlock *lruPrev;
+    struct CacheBlock *lruNext;
+} CacheBlock;
+
+// Size-bounded LRU cache of file blocks shared by every session in the
+// process. In threaded mode all workers read through the same cache; a
+// block missing from it is read from disk once while other readers wait.
+typedef struct {
+    CacheBlock *buckets[CACHE_BUCKETS];
+    CacheBlock *lruHead;       // most recently used
+    CacheBlock *lruTail;
+    uint64_t capacity;
+    uint64_t used;
+    uint64_t hits;
+    uint64_t misses;
+
+    FileVersion *files;        // last version seen of each file, for invalidation
+    int fileCount;
+    int fileCap;
+
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+} BlockCache;
+
+void initBlockCache(BlockCache *cache, uint64_t capacity);
+
+// Records the version a session is about to read. If the same file was
+// cached at another size or mtime, its old blocks are dropped.
+void checkFileVersion(BlockCache *cache, const FileVersion *version);
+
+// Returns block index of the file open on fd, pinned, reading it with
+// pread on a miss. Returns NULL if the read failed.
+CacheBlock *acquireBlock(BlockCache *cache, const FileVersion *version, int fd,
+                         uint32_t bufSize, uint64_t index);
+
+// Unpins a block returned by acquireBlock.
+void releaseBlock(BlockCache *cache, CacheBlock *block);
+
+void printCacheStats(BlockCache *cache);
+
+void freeBlockCache(BlockCache *cache);
+
+#endif
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "congestion.h"
+
+static void clampWindow(CongestionControl *cc);
+static void fixedInit(CongestionControl *cc);
+static void fixedEvent(CongestionControl *cc, uint64_t nowMs);
+static void fixedAck(CongestionControl *cc, uint32_t acked, uint64_t nowMs, uint64_t srttUs);
+static void renoInit(CongestionControl *cc);
+static void renoAck(CongestionControl *cc, uint32_t acked, uint64_t nowMs, uint64_t srttUs);
+static void renoLoss(CongestionControl *cc, uint64_t nowMs);
+static void renoTimeout(CongestionControl *cc, uint64_t nowMs);
+static void cubicAck(CongestionControl *cc, uint32_t acked, uint64_t nowMs, uint64_t srttUs);
+static void cubicLoss(CongestionControl *cc, uint64_t nowMs);
+static void cubicTimeout(CongestionControl *cc, uint64_t nowMs);
+static void bbrInit(CongestionControl *cc);
+static void bbrTimeout(CongestionControl *cc, uint64_t nowMs);
+static void bbrDelivery(CongestionControl *cc, const RateSample *rs);
+static void bbrUpdateBandwidth(CongestionControl *cc, const RateSample *rs);
+static void bbrUpdateState(CongestionControl *cc, const RateSample *rs);
+static void bbrEnterProbeBw(CongestionControl *cc, uint64_t nowUs);
+static double bbrBdp(const CongestionControl *cc);
+
+const CongestionOps fixedCongestion = {"fixed", fixedInit, fixedAck, fixedEvent, fixedEvent};
+const CongestionOps renoCongestion = {"reno", renoInit, renoAck, renoLoss, renoTimeout};
+const CongestionOps cubicCongestion = {"cubic", renoInit, cubicAck, cubicLoss, cubicTimeout};
+const CongestionOps bbrCongestion = {"bbr", bbrInit, fixedAck, fixedEvent, bbrTimeout, bbrDelivery};
+
+static const CongestionOps *const allCongestionOps[] = {
+    &fixedCongestion, &renoCongestion, &cubicCongestion, &bbrCongestion
+};
+
+static const double bbrCycleGains[BBR_CYCLE_LEN] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+const CongestionOps *findCongestionOps(const char *name){
+    for (size_t i = 0; i < sizeof(allCongestionOps) / sizeof(allCongestionOps[0]); i++) {
+        if (strcmp(allCongestionOps[i]->name, name) == 0) {
+            return allCongestionOps[i];
+        }
+    }
+    return NULL;
+}
+
+void initCongestion(CongestionControl *cc, const CongestionOps *ops, uint32_t maxWindow){
+    memset(cc, 0, sizeof(CongestionControl));
+    cc->ops = ops;
+    cc->maxWindow = maxWindow;
+    cc->ops->init(cc);
+    clampWindow(cc);
+}
+
+uint32_t congestionWindow(const CongestionControl *cc){
+    return (uint32_t)cc->cwnd;
+}
+
+uint32_t pacingQuantum(const CongestionControl *cc){
+    uint32_t quantum = (uint32_t)(cc->pacingRate / 1000);
+    if (quantum < 2) {
+        return 2;
+    }
+    return quantum < PACE_MAX_QUANTUM ? quantum : PACE_MAX_QUANTUM;
+}
+
+void congestionAcked(CongestionControl *cc, uint32_t acked, uint64_t ackSeq, uint64_t nowMs, uint64_t srttUs){
+    // No growth until the packets outstanding at the loss are all acknowledged
+    if (ackSeq < cc->growSeq) {
+        return;
+    }
+    cc->ops->onAck(cc, acked, nowMs, srttUs);
+    clampWindow(cc);
+}
+
+void congestionLoss(CongestionControl *cc, uint64_t lostSeq, uint64_t nextSeq, uint64_t nowMs){
+    if (lostSeq < cc->recoverSeq) {
+        return;
+    }
+    double before = cc->cwnd;
+    cc->recoverSeq = nextSeq;
+    cc->growSeq = nextSeq;
+    cc->ops->onLoss(cc, nowMs);
+    clampWindow(cc);
+    if (cc->cwnd != before) {
+        printf("Congestion (%s): loss at seq=%llu, cwnd %.1f -> %.1f\n", cc->ops->name,
+               (unsigned long long)lostSeq, before, cc->cwnd);
+    }
+}
+
+// The window restarts from one packet and the old one is resent as it
+// reopens, so slow start has to grow on the acks for those resends.
+void congestionTimeout(CongestionControl *cc, uint64_t nextSeq, uint64_t nowMs){
+    double before = cc->cwnd;
+    cc->recoverSeq = nextSeq;
+    cc->growSeq = 0;
+    cc->ops->onTimeout(cc, nowMs);
+    clampWindow(cc);
+    if (cc->cwnd != before) {
+        printf("Congestion (%s): timeout, cwnd %.1f -> %.1f\n", cc->ops->name, before, cc->cwnd);
+    }
+}
+
+void congestionSent(CongestionControl *cc, DeliveryStamp *stamp, uint32_t inflight, bool appLimited, uint64_t nowUs){
+    // Starting from idle, the time before this send isn't part of any delivery
+    if (inflight == 0 || cc->deliveredUs == 0) {
+        cc->deliveredUs = nowUs;
+    }
+    stamp->delivered = cc->delivered;
+    stamp->deliveredUs = cc->deliveredUs;
+    stamp->appLimited = appLimited;
+}
+
+void congestionDelivered(CongestionControl *cc, uint32_t acked, const DeliveryStamp *stamp,
+                         uint64_t rttUs, uint32_t inflight, uint64_t nowUs){
+    cc->delivered += acked;
+    cc->deliveredUs = nowUs;
+
+    RateSample rs = {
+        .acked = acked, .rttUs = rttUs, .inflight = inflight,
+        .appLimited = stamp->appLimited, .nowUs = nowUs
+    };
+    if (stamp->delivered >= cc->roundDelivered) {
+        cc->rounds++;
+        cc->roundDelivered = cc->delivered;
+        rs.roundStart = true;
+    }
+
+    rs.minRttExpired = cc->minRttUs != 0 && nowUs - cc->minRttStampUs > MIN_RTT_WINDOW_US;
+    if (rttUs > 0 && (cc->minRttUs == 0 || rttUs <= cc->minRttUs || rs.minRttExpired)) {
+        cc->minRttUs = rttUs;
+        cc->minRttStampUs = nowUs;
+    }
+
+    // Acks bunched up closer than a round trip would overstate the rate
+    uint64_t intervalUs = nowUs - stamp->deliveredUs;
+    if (intervalUs > 0 && intervalUs >= cc->minRttUs) {
+        rs.rate = (cc->delivered - stamp->delivered) * 1000000.0 / intervalUs;
+    }
+
+    if (cc->ops->onDelivery) {
+        cc->ops->onDelivery(cc, &rs);
+        clampWindow(cc);
+    }
+}
+
+static void clampWindow(CongestionControl *cc){
+    if (cc->cwnd > cc->maxWindow) {
+        cc->cwnd = cc->maxWindow;
+    }
+    if (cc->cwnd < 1) {
+        cc->cwnd = 1;
+    }
+}
+
+// ----- Fixed -----
+static void fixedInit(CongestionControl *cc){
+    cc->cwnd = cc->maxWindow;
+}
+
+static void fixedEvent(CongestionControl *cc, uint64_t nowMs){
+    (void)cc;
+    (void)nowMs;
+}
+
+static void fixedAck(CongestionControl *cc, uint32_t acked, uint64_t nowMs, uint64_t srttUs){
+    (void)cc;
+    (void)acked;
+    (void)nowMs;
+    (void)srttUs;
+}
+
+// ----- Reno -----
+static void renoInit(CongestionControl *cc){
+    cc->cwnd = CC_INITIAL_WINDOW;
+    cc->ssthresh = cc->maxWindow;
+}
+
+static void renoAck(CongestionControl *cc, uint32_t acked, uint64_t nowMs, uint64_t srttUs){
+    (void)nowMs;
+    (void)srttUs;
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += acked;                 // slow start
+    } else {
+        cc->cwnd += acked / cc->cwnd;      // one packet per window
+    }
+}
+
+static void renoLoss(CongestionControl *cc, uint64_t nowMs){
+    (void)nowMs;
+    cc->ssthresh = cc->cwnd / 2 > CC_MIN_SSTHRESH ? cc->cwnd / 2 : CC_MIN_SSTHRESH;
+    cc->cwnd = cc->ssthresh;
+}
+
+static void renoTimeout(CongestionControl *cc, uint64_t nowMs){
+    renoLoss(cc, nowMs);
+    cc->cwnd = 1;
+}
+
+// ----- CUBIC (RFC 8312) -----
+// Past ssthresh the window follows W(t) = C * (t - K)^3 + Wmax, t being the
+// time since the last loss, so it climbs back quickly to where the loss
+// happened, flattens out there and only then probes further. Where Reno
+// would be ahead (short RTTs) it grows like Reno instead.
+static void cubicAck(CongestionControl *cc, uint32_t acked, uint64_t nowMs, uint64_t srttUs){
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += acked;
+        return;
+    }
+
+    if (cc->epochStartMs == 0) {
+        cc->epochStartMs = nowMs;
+        if (cc->cwnd < cc->wMax) {
+            cc->k = cbrt((cc->wMax - cc->cwnd) / CUBIC_C);
+            cc->origin = cc->wMax;
+        } else {
+            cc->k = 0;
+            cc->origin = cc->cwnd;
+        }
+        cc->wEst = cc->cwnd;
+    }
+
+    double t = (nowMs - cc->epochStartMs) / 1000.0 + srttUs / 1000000.0;
+    double target = cc->origin + CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k);
+    if (target > cc->cwnd) {
+        cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+    } else {
+        cc->cwnd += 0.01 * acked / cc->cwnd;   // on the plateau, barely
+    }
+
+    cc->wEst += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->cwnd;
+    if (cc->wEst > cc->cwnd) {
+        cc->cwnd = cc->wEst;
+    }
+}
+
+static void cubicLoss(CongestionControl *cc, uint64_t nowMs){
+    (void)nowMs;
+    cc->epochStartMs = 0;
+    // Fast convergence: a flow losing below its last peak gives way to newer flows
+    if (cc->cwnd < cc->wMax) {
+        cc->wMax = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    } else {
+        cc->wMax = cc->cwnd;
+    }
+    cc->cwnd = cc->cwnd * CUBIC_BETA > CC_MIN_SSTHRESH ? cc->cwnd * CUBIC_BETA : CC_MIN_SSTHRESH;
+    cc->ssthresh = cc->cwnd;
+}
+
+static void cubicTimeout(CongestionControl *cc, uint64_t nowMs){
+    cubicLoss(cc, nowMs);
+    cc->cwnd = 1;
+}
+
+// ----- BBR -----
+// Models the path instead of reacting to loss: the bottleneck bandwidth is
+// the highest delivery rate of the last BBR_BW_ROUNDS round trips, the
+// propagation delay the lowest RTT of the last ten seconds. Packets are
+// paced at gain * bandwidth and cwnd is kept near twice their product. The
+// gain starts high to find the bandwidth, drops to drain the queue that
+// built and then cycles around 1 to keep probing for more.
+static void bbrInit(CongestionControl *cc){
+    cc->cwnd = CC_INITIAL_WINDOW;
+    cc->ssthresh = cc->maxWindow;
+    cc->bbrState = BBR_STARTUP;
+    cc->pacingGain = BBR_HIGH_GAIN;
+    cc->cwndGain = BBR_HIGH_GAIN;
+    cc->pacingRate = 0;   // the initial window goes out at once, there is no RTT yet
+}
+
+static void bbrTimeout(CongestionControl *cc, uint64_t nowMs){
+    (void)nowMs;
+    cc->cwnd = 1;   // grows back by what is delivered, up to the model's window
+}
+
+static void bbrDelivery(CongestionControl *cc, const RateSample *rs){
+    bbrUpdateBandwidth(cc, rs);
+    bbrUpdateState(cc, rs);
+    if (cc->maxBw == 0) {
+        return;
+    }
+
+    cc->pacingRate = cc->pacingGain * cc->maxBw;
+    if (cc->bbrState == BBR_PROBE_RTT) {
+        cc->cwnd = BBR_MIN_CWND;
+        return;
+    }
+    // Three quanta on top, so that bursts sent and acked in batches don't
+    // leave the window short where the RTT is mostly the hosts' own time
+    double target = cc->cwndGain * bbrBdp(cc) + 3 * pacingQuantum(cc);
+    if (target < BBR_MIN_CWND) {
+        target = BBR_MIN_CWND;
+    }
+    if (cc->fullBwReached) {
+        cc->cwnd = cc->cwnd + rs->acked < target ? cc->cwnd + rs->acked : target;
+    } else if (cc->cwnd < target || cc->delivered < CC_INITIAL_WINDOW) {
+        cc->cwnd += rs->acked;
+    }
+}
+
+static void bbrUpdateBandwidth(CongestionControl *cc, const RateSample *rs){
+    double *round = &cc->bwRounds[cc->rounds % BBR_BW_ROUNDS];
+    if (rs->roundStart) {
+        *round = 0;
+    }
+    // An app-limited sample only says the path can do at least that much
+    if (rs->rate > *round && (!rs->appLimited || rs->rate >= cc->maxBw)) {
+        *round = rs->rate;
+    }
+    cc->maxBw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++) {
+        if (cc->bwRounds[i] > cc->maxBw) {
+            cc->maxBw = cc->bwRounds[i];
+        }
+    }
+}
+
+static void bbrUpdateState(CongestionControl *cc, const RateSample *rs){
+    if (cc->bbrState == BBR_STARTUP && rs->roundStart && !rs->appLimited && cc->maxBw > 0) {
+        if (cc->maxBw >= cc->fullBw * 1.25) {
+            cc->fullBw = cc->maxBw;
+            cc->fullBwCount = 0;
+        } else if (++cc->fullBwCount >= BBR_FULL_BW_ROUNDS) {
+            cc->fullBwReached = true;
+            cc->bbrState = BBR_DRAIN;
+            cc->pacingGain = 1 / BBR_HIGH_GAIN;
+            printf("Congestion (bbr): bandwidth %.0f pkt/s, min RTT %.3f ms, draining\n",
+                   cc->maxBw, cc->minRttUs / 1000.0);
+        }
+    }
+    if (cc->bbrState == BBR_DRAIN && rs->inflight <= bbrBdp(cc)) {
+        bbrEnterProbeBw(cc, rs->nowUs);
+    }
+    if (cc->bbrState == BBR_PROBE_BW && rs->nowUs - cc->cycleStampUs > cc->minRttUs) {
+        cc->cycleIndex = (cc->cycleIndex + 1) % BBR_CYCLE_LEN;
+        cc->cycleStampUs = rs->nowUs;
+        cc->pacingGain = bbrCycleGains[cc->cycleIndex];
+    }
+
+    // Every MIN_RTT_WINDOW_US without a lower RTT, empty the queue for a
+    // moment so the next sample sees the path without it
+    if (rs->minRttExpired && cc->bbrState != BBR_PROBE_RTT) {
+        cc->bbrState = BBR_PROBE_RTT;
+        cc->pacingGain = 1;
+        cc->probeRttDoneUs = 0;
+    }
+    if (cc->bbrState == BBR_PROBE_RTT) {
+        if (cc->probeRttDoneUs == 0 && rs->inflight <= BBR_MIN_CWND) {
+            cc->probeRttDoneUs = rs->nowUs + BBR_PROBE_RTT_US;
+        } else if (cc->probeRttDoneUs != 0 && rs->nowUs >= cc->probeRttDoneUs) {
+            cc->minRttStampUs = rs->nowUs;
+            if (cc->fullBwReached) {
+                bbrEnterProbeBw(cc, rs->nowUs);
+            } else {
+                cc->bbrState = BBR_STARTUP;
+                cc->pacingGain = BBR_HIGH_GAIN;
+            }
+        }
+    }
+}
+
+static void bbrEnterProbeBw(CongestionControl *cc, uint64_t nowUs){
+    cc->bbrState = BBR_PROBE_BW;
+    cc->cwndGain = BBR_CWND_GAIN;
+    cc->cycleIndex = nowUs % (BBR_CYCLE_LEN - 1) + 1;   // anywhere but the probing phase
+    cc->cycleStampUs = nowUs;
+    cc->pacingGain = bbrCycleGains[cc->cycleIndex];
+}
+
+// Packets the path holds at the bandwidth estimate and min RTT.
+static double bbrBdp(const CongestionControl *cc){
+    return cc->maxBw * cc->minRttUs / 1000000.0;
+}
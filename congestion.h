@@ -0,0 +1,134 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CC_INITIAL_WINDOW 10   // packets, RFC 6928
+#define CC_MIN_SSTHRESH 2
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define MIN_RTT_WINDOW_US 10000000   // a min RTT older than this is replaced by the next sample
+
+// ----- BBR -----
+#define BBR_HIGH_GAIN 2.885          // 2/ln2: doubles the delivery rate every round in startup
+#define BBR_CWND_GAIN 2.0
+#define BBR_BW_ROUNDS 10             // bandwidth is the max sample of this many rounds
+#define BBR_FULL_BW_ROUNDS 3         // rounds without 25% growth that end startup
+#define BBR_CYCLE_LEN 8
+#define BBR_PROBE_RTT_US 200000      // time spent at BBR_MIN_CWND to remeasure min RTT
+#define BBR_MIN_CWND 4
+#define PACE_MAX_QUANTUM 44          // packets sent back to back: 64 KB, as one GSO/TSO burst
+
+struct CongestionControl;
+
+// ----- Delivery Rate -----
+// Taken whenever a packet is sent. When the packet is acknowledged, the
+// packets delivered since, over the time since, give a rate sample.
+typedef struct {
+    uint64_t delivered;     // cc->delivered at send time
+    uint64_t deliveredUs;   // when the last of those was delivered
+    bool appLimited;        // the sender had nothing more to send, not the path
+} DeliveryStamp;
+
+typedef struct {
+    double rate;            // packets per second, 0 if the interval can't be trusted
+    uint32_t acked;         // packets newly delivered by this ack
+    uint64_t rttUs;         // RTT sample from the same ack, 0 if none (Karn's rule)
+    uint32_t inflight;      // packets outstanding after the ack
+    bool appLimited;
+    bool roundStart;        // first ack for a packet sent in the current round trip
+    bool minRttExpired;     // the min RTT was MIN_RTT_WINDOW_US old before this ack
+    uint64_t nowUs;
+} RateSample;
+
+typedef enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT } bbr_state_t;
+
+// One congestion control algorithm. The hooks only move cwnd and ssthresh;
+// congestionAcked() and friends around them handle recovery and clamping.
+typedef struct CongestionOps {
+    const char *name;
+    void (*init)(struct CongestionControl *cc);
+    void (*onAck)(struct CongestionControl *cc, uint32_t acked, uint64_t nowMs, uint64_t srttUs);
+    void (*onLoss)(struct CongestionControl *cc, uint64_t nowMs);      // a hole, once per window
+    void (*onTimeout)(struct CongestionControl *cc, uint64_t nowMs);
+    void (*onDelivery)(struct CongestionControl *cc, const RateSample *rs);   // optional
+} CongestionOps;
+
+// Per-session congestion state, in packets. The client's window is only the
+// upper bound: the session keeps min(cwnd, its window) outstanding.
+typedef struct CongestionControl {
+    const CongestionOps *ops;
+    double cwnd;
+    double ssthresh;
+    uint32_t maxWindow;    // the client's window
+    uint64_t recoverSeq;   // losses below this belong to the episode already handled
+    uint64_t growSeq;      // acks below this don't grow cwnd
+    double pacingRate;     // packets per second, 0 to send as soon as the window opens
+
+    // ----- Delivery rate -----
+    uint64_t delivered;       // packets acknowledged or SACKed so far
+    uint64_t deliveredUs;     // when the last of them was
+    uint64_t roundDelivered;  // delivered when the current round trip began
+    uint64_t rounds;
+    uint64_t minRttUs;        // 0 until the first sample
+    uint64_t minRttStampUs;
+
+    // ----- CUBIC -----
+    double wMax;           // cwnd at the last loss
+    double k;              // seconds the cubic takes to climb back to wMax
+    double origin;         // plateau of the current epoch
+    double wEst;           // what Reno would have by now (TCP-friendly region)
+    uint64_t epochStartMs; // 0 until the first ack after a loss
+
+    // ----- BBR -----
+    bbr_state_t bbrState;
+    double bwRounds[BBR_BW_ROUNDS];  // max delivery rate of each recent round
+    double maxBw;                    // packets per second
+    double fullBw;                   // startup: bandwidth a round had to beat by 25%
+    int fullBwCount;
+    bool fullBwReached;
+    double pacingGain;
+    double cwndGain;
+    int cycleIndex;
+    uint64_t cycleStampUs;
+    uint64_t probeRttDoneUs;         // 0 until the window has drained to BBR_MIN_CWND
+} CongestionControl;
+
+extern const CongestionOps fixedCongestion;   // always the client's window, as before
+extern const CongestionOps renoCongestion;
+extern const CongestionOps cubicCongestion;
+extern const CongestionOps bbrCongestion;     // paced at its bottleneck bandwidth estimate
+
+// The algorithm called name ("fixed", "reno", "cubic" or "bbr"), or NULL.
+const CongestionOps *findCongestionOps(const char *name);
+
+void initCongestion(CongestionControl *cc, const CongestionOps *ops, uint32_t maxWindow);
+
+// Whole packets the session may have outstanding, 1 to maxWindow.
+uint32_t congestionWindow(const CongestionControl *cc);
+
+// Packets a paced session may send back to back: a millisecond's worth at
+// the pacing rate, 2 to PACE_MAX_QUANTUM.
+uint32_t pacingQuantum(const CongestionControl *cc);
+
+// An RR moved the window up to ackSeq, acknowledging acked new packets.
+void congestionAcked(CongestionControl *cc, uint32_t acked, uint64_t ackSeq, uint64_t nowMs, uint64_t srttUs);
+
+// lostSeq has to be resent (SREJ or SACK hole). Only the first loss per
+// window of data counts: nextSeq marks where the episode ends.
+void congestionLoss(CongestionControl *cc, uint64_t lostSeq, uint64_t nextSeq, uint64_t nowMs);
+
+// The retransmit timer expired. Holes below nextSeq belong to this episode,
+// but acks below it still grow the collapsed window.
+void congestionTimeout(CongestionControl *cc, uint64_t nextSeq, uint64_t nowMs);
+
+// A packet is going out with inflight others outstanding; fills its stamp.
+void congestionSent(CongestionControl *cc, DeliveryStamp *stamp, uint32_t inflight, bool appLimited, uint64_t nowUs);
+
+// An RR or SACK delivered acked packets, the newest of them sent under
+// stamp. rttUs is the RTT sample the same ack gave, 0 if none.
+void congestionDelivered(CongestionControl *cc, uint32_t acked, const DeliveryStamp *stamp,
+                         uint64_t rttUs, uint32_t inflight, uint64_t nowUs);
+
+#endif
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "safeUtil.h"
+#include "cpe464.h"
+#include "eventLoop.h"
+#include "udpIo.h"
+
+static void listenReadable(EventLoop *loop);
+static void acceptPdu(EventLoop *loop, uint8_t *buffer, int len, struct sockaddr_in6 *src);
+static void acceptSession(EventLoop *loop, ChildContext *child);
+static void addSession(EventLoop *loop, ChildContext *child);
+static ChildContext *findSession(EventLoop *loop, struct sockaddr_in6 *client, uint32_t nonce);
+static ChildContext *findSessionById(EventLoop *loop, uint32_t sessionId);
+static void unlinkSessionId(EventLoop *loop, ChildContext *child);
+static void reapSessions(EventLoop *loop);
+static int  nextTimeout(EventLoop *loop);
+static void expireTimers(EventLoop *loop);
+static void paceSessions(EventLoop *loop);
+static void rebalanceWindows(EventLoop *loop);
+
+void initEventLoop(EventLoop *loop, int listenSocket, double errorRate, bool multiplex,
+                   Admission *admission){
+    memset(loop, 0, sizeof(EventLoop));
+    loop->listenSocket = listenSocket;
+    loop->error_rate = errorRate;
+    loop->multiplex = multiplex;
+    loop->admission = admission;
+    loop->lastSessionId = (uint32_t)(getTimeMs() << 8);   // so IDs from a previous run rarely match
+    loop->sessionCap = SESSION_TABLE_SIZE;
+    loop->sessions = sCalloc(loop->sessionCap, sizeof(ChildContext *));
+
+    if ((loop->epollFd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listen socket is registered with a NULL pointer, sessions with
+    // their context, the io_uring (SENDER_URING) with the loop itself and
+    // the pace timer with its own field.
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, listenSocket, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->paceTimer = openPaceTimer();
+    struct epoll_event paceEv = {.events = EPOLLIN, .data.ptr = &loop->paceTimer};
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->paceTimer, &paceEv) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    int ringFd = sessionUringFd();
+    if (ringFd >= 0) {
+        struct epoll_event ringEv = {.events = EPOLLIN, .data.ptr = loop};
+        if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, ringFd, &ringEv) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void runEventLoop(EventLoop *loop){
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(loop->epollFd, events, EVENT_LOOP_MAX_EVENTS, nextTimeout(loop));
+        if (n < 0 && errno == EINTR) {
+            continue;   // io_uring completions can interrupt the wait
+        }
+        if (n < 0) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *owner = events[i].data.ptr;
+            if (owner == NULL) {
+                listenReadable(loop);
+            } else if (owner == loop) {
+                reapSessionUring();
+            } else if (owner == &loop->paceTimer) {
+                clearPaceTimer(loop->paceTimer);
+                loop->paceArmedUs = 0;
+            } else if (!((ChildContext *)owner)->done) {
+                sessionReadable(owner);
+            }
+        }
+
+        expireTimers(loop);
+        paceSessions(loop);
+        reapSessions(loop);
+        rebalanceWindows(loop);
+    }
+}
+
+void freeEventLoop(EventLoop *loop){
+    for (int i = 0; i < loop->sessionCount; i++) {
+        releaseClient(loop->admission, loop->sessions[i]);
+        finishTransfer(loop->sessions[i]);
+        free(loop->sessions[i]);
+    }
+    free(loop->sessions);
+    close(loop->paceTimer);
+    close(loop->epollFd);
+}
+
+// Filename packets always arrive here. In multiplexed mode so does every
+// control PDU: each session named in the batch is handed all of its PDUs
+// at once, so one RR slides its window and one pass resends its holes.
+static void listenReadable(EventLoop *loop){
+    uint8_t buffers[RECV_BATCH_MAX][MAX_PDU_SIZE];
+    int lens[RECV_BATCH_MAX];
+    struct sockaddr_in6 srcs[RECV_BATCH_MAX];
+    uint32_t ids[RECV_BATCH_MAX];
+    bool control[RECV_BATCH_MAX];   // still to be handed to its session
+
+    int count = recvPdus(loop->listenSocket, buffers, lens, RECV_BATCH_MAX, srcs);
+    for (int i = 0; i < count; i++) {
+        control[i] = false;
+        if (lens[i] < (int)sizeof(pdu_header) || in_cksum((unsigned short *)buffers[i], lens[i])) {
+            printf("Corrupt or short packet on listen socket, ignoring\n");
+            continue;
+        }
+        pdu_header header;
+        memcpy(&header, buffers[i], sizeof(pdu_header));
+        if (header.flag == 8) {
+            acceptPdu(loop, buffers[i], lens[i], &srcs[i]);
+            continue;
+        }
+        ids[i] = ntohl(header.session);
+        control[i] = true;
+    }
+
+    uint8_t batch[RECV_BATCH_MAX][MAX_PDU_SIZE];
+    int batchLens[RECV_BATCH_MAX];
+    for (int i = 0; i < count; i++) {
+        if (!control[i]) {
+            continue;
+        }
+        int n = 0;
+        for (int j = i; j < count; j++) {
+            if (control[j] && ids[j] == ids[i]) {
+                memcpy(batch[n], buffers[j], lens[j]);
+                batchLens[n++] = lens[j];
+                control[j] = false;
+            }
+        }
+
+        ChildContext *session = loop->multiplex ? findSessionById(loop, ids[i]) : NULL;
+        if (session && !session->done) {
+            handleControlBatch(session, batch, batchLens, n);
+        } else {
+            printf("%d control PDUs for unknown session %u, ignoring\n", n, ids[i]);
+        }
+    }
+}
+
+static void acceptPdu(EventLoop *loop, uint8_t *buffer, int len, struct sockaddr_in6 *src){
+    ChildContext *child = sCalloc(1, sizeof(ChildContext));
+    child->client = *src;
+    child->clientAddrLen = sizeof(child->client);
+    memcpy(child->pduBuffer, buffer, len);
+    child->pduLen = len;
+    acceptSession(loop, child);
+}
+
+static void acceptSession(EventLoop *loop, ChildContext *child){
+    child->error_rate = loop->error_rate;
+    child->socketNum = -1;
+    if (parseFilenamePdu(child, child->pduLen, child->pduBuffer) != 0) {
+        free(child);
+        return;
+    }
+
+    // A retransmitted filename packet is answered from the session it already has
+    ChildContext *existing = findSession(loop, &child->client, child->nonce);
+    if (existing) {
+        printf("Duplicate filename packet (nonce %u), resending ACK\n", child->nonce);
+        resendHandshakeAck(existing->socketNum, &child->client, existing->sessionId,
+                           existing->ackPayload, existing->ackLen);
+        free(child);
+        return;
+    }
+
+    if (admitClient(loop->admission, child, loop->listenSocket) != 0) {
+        free(child);
+        return;
+    }
+
+    child->sessionId = allocSessionId(&loop->lastSessionId);
+    if (loop->multiplex) {
+        child->socketNum = loop->listenSocket;   // shared, so ownsSocket stays false
+    } else if (openSessionSocket(child) < 0) {
+        releaseClient(loop->admission, child);
+        free(child);
+        return;
+    }
+
+    if (answerHandshake(child) != 0 || beginTransfer(child) != 0) {
+        releaseClient(loop->admission, child);
+        finishTransfer(child);
+        free(child);
+        return;
+    }
+    addSession(loop, child);
+}
+
+static ChildContext *findSession(EventLoop *loop, struct sockaddr_in6 *client, uint32_t nonce){
+    for (int i = 0; i < loop->sessionCount; i++) {
+        ChildContext *child = loop->sessions[i];
+        if (sameHandshake(&child->client, child->nonce, client, nonce)) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+static ChildContext *findSessionById(EventLoop *loop, uint32_t sessionId){
+    ChildContext *child = loop->byId[sessionId % SESSION_ID_BUCKETS];
+    while (child && child->sessionId != sessionId) {
+        child = child->idNext;
+    }
+    return child;
+}
+
+static void unlinkSessionId(EventLoop *loop, ChildContext *child){
+    ChildContext **link = &loop->byId[child->sessionId % SESSION_ID_BUCKETS];
+    while (*link && *link != child) {
+        link = &(*link)->idNext;
+    }
+    if (*link) {
+        *link = child->idNext;
+    }
+}
+
+static void addSession(EventLoop *loop, ChildContext *child){
+    if (loop->sessionCount == loop->sessionCap) {
+        loop->sessionCap *= 2;
+        loop->sessions = srealloc(loop->sessions, loop->sessionCap * sizeof(ChildContext *));
+    }
+    loop->sessions[loop->sessionCount++] = child;
+
+    ChildContext **bucket = &loop->byId[child->sessionId % SESSION_ID_BUCKETS];
+    child->idNext = *bucket;
+    *bucket = child;
+
+    // Multiplexed sessions have no socket of their own to watch
+    if (!loop->multiplex) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = child};
+        if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, child->socketNum, &ev) < 0) {
+            perror("epoll_ctl");
+            child->done = true;
+        }
+    }
+    printf("Session %u added: %d active\n", child->sessionId, loop->sessionCount);
+}
+
+// Drops finished sessions from the table. Closing the socket also removes
+// it from the epoll set.
+static void reapSessions(EventLoop *loop){
+    int i = 0;
+    while (i < loop->sessionCount) {
+        ChildContext *child = loop->sessions[i];
+        if (child->done) {
+            unlinkSessionId(loop, child);
+            releaseClient(loop->admission, child);
+            finishTransfer(child);
+            free(child);
+            loop->sessions[i] = loop->sessions[--loop->sessionCount];
+            printf("Session removed: %d active\n", loop->sessionCount);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Milliseconds until the earliest session deadline, or forever when idle.
+static int nextTimeout(EventLoop *loop){
+    if (loop->sessionCount == 0) {
+        return -1;
+    }
+
+    uint64_t now = getTimeMs();
+    uint64_t earliest = loop->sessions[0]->deadline;
+    for (int i = 1; i < loop->sessionCount; i++) {
+        if (loop->sessions[i]->deadline < earliest) {
+            earliest = loop->sessions[i]->deadline;
+        }
+    }
+    return earliest <= now ? 0 : (int)(earliest - now);
+}
+
+static void expireTimers(EventLoop *loop){
+    uint64_t now = getTimeMs();
+    for (int i = 0; i < loop->sessionCount; i++) {
+        ChildContext *child = loop->sessions[i];
+        if (!child->done && child->deadline <= now) {
+            sessionTimeout(child);
+        }
+    }
+}
+
+// Sends whatever paced packets are due and arms the pace timer for the
+// earliest that isn't. Sessions without a pacing rate never wait here.
+static void paceSessions(EventLoop *loop){
+    uint64_t now = getTimeUs();
+    uint64_t earliest = 0;
+    for (int i = 0; i < loop->sessionCount; i++) {
+        ChildContext *child = loop->sessions[i];
+        if (child->done || !child->paceWaiting) {
+            continue;
+        }
+        if (child->paceAtUs <= now + PACE_SLACK_US) {
+            sessionPace(child);
+        }
+        if (child->paceWaiting && (earliest == 0 || child->paceAtUs < earliest)) {
+            earliest = child->paceAtUs;
+        }
+    }
+    if (earliest != loop->paceArmedUs) {
+        armPaceTimer(loop->paceTimer, earliest);
+        loop->paceArmedUs = earliest;
+    }
+}
+
+// Under memory pressure, sessions above the fair share are limited to it and
+// whatever their window buffers give back returns to the budget.
+static void rebalanceWindows(EventLoop *loop){
+    if (loop->sessionCount == 0) {
+        return;
+    }
+    for (int i = 0; i < loop->sessionCount; i++) {
+        ChildContext *child = loop->sessions[i];
+        if (child->done) {
+            continue;
+        }
+        uint32_t fair = fairWindow(loop->admission, child->bufSize);
+        if (fair > 0 && child->sendWindow > fair) {
+            limitSessionWindow(child, fair);
+        }
+        shrinkGrant(loop->admission, child);
+    }
+}
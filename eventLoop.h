@@ -0,0 +1,39 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "session.h"
+#include "admission.h"
+
+#define EVENT_LOOP_MAX_EVENTS 64
+#define SESSION_TABLE_SIZE 16
+#define SESSION_ID_BUCKETS 256
+
+// Single-process server: every session lives in this table and is advanced
+// by one epoll loop instead of a forked child. In multiplexed mode every
+// session shares the listen socket and control PDUs are routed by the
+// session ID in their header instead of by socket.
+typedef struct {
+    int epollFd;
+    int listenSocket;
+    int paceTimer;             // wakes the loop for paced sessions' next packets
+    uint64_t paceArmedUs;      // what paceTimer is armed for, 0 when disarmed
+    double error_rate;
+    bool multiplex;
+    Admission *admission;      // shared with other loops in threaded mode
+    uint32_t lastSessionId;
+    ChildContext **sessions;   // session table
+    int sessionCount;
+    int sessionCap;
+    ChildContext *byId[SESSION_ID_BUCKETS];   // session ID hash, chained via idNext
+} EventLoop;
+
+void initEventLoop(EventLoop *loop, int listenSocket, double errorRate, bool multiplex,
+                   Admission *admission);
+
+// Runs forever: accepts filename packets on the listen socket and advances
+// all sessions on socket readiness and timer expiry.
+void runEventLoop(EventLoop *loop);
+
+void freeEventLoop(EventLoop *loop);
+
+#endif
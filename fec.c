@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+#include "safeUtil.h"
+
+static void startGroup(FecEncoder *enc, FecSum *sum, uint64_t group);
+static void xorBytes(uint8_t *dst, const uint8_t *src, uint32_t len);
+
+// ----- Encoder -----
+void initFecEncoder(FecEncoder *enc, uint16_t groupSize, uint8_t maxParity, uint32_t bufSize, uint32_t windowSize){
+    memset(enc, 0, sizeof(FecEncoder));
+    enc->groupSize = groupSize;
+    enc->maxParity = maxParity;
+    enc->parity = 1;
+    enc->bufSize = bufSize;
+    enc->group = MAX_INT_64;
+    enc->slots = windowSize / groupSize + 2;
+    enc->sums = sCalloc(enc->slots, sizeof(FecSum));
+    enc->slab = sCalloc((size_t)enc->slots * maxParity, FEC_HEADER_SIZE + bufSize);
+    for (int i = 0; i < enc->slots; i++) {
+        enc->sums[i].group = MAX_INT_64;
+        enc->sums[i].sums = enc->slab + (size_t)i * maxParity * (FEC_HEADER_SIZE + bufSize);
+    }
+}
+
+void freeFecEncoder(FecEncoder *enc){
+    free(enc->sums);
+    free(enc->slab);
+    enc->sums = NULL;
+    enc->slab = NULL;
+    enc->groupSize = 0;
+}
+
+int fecEncode(FecEncoder *enc, uint64_t seq, const uint8_t *data){
+    uint64_t group = seq - seq % enc->groupSize;
+    FecSum *sum = &enc->sums[(group / enc->groupSize) % enc->slots];
+    if (sum->group != group) {
+        startGroup(enc, sum, group);
+    }
+    uint64_t bit = 1ULL << (seq - group);
+    if (sum->added & bit) {
+        return 0;   // summed already
+    }
+    sum->added |= bit;
+    uint32_t index = (seq - group) % sum->parity;
+    xorBytes(sum->sums + (size_t)index * (FEC_HEADER_SIZE + enc->bufSize) + FEC_HEADER_SIZE, data, enc->bufSize);
+    uint64_t full = enc->groupSize == 64 ? ~0ULL : (1ULL << enc->groupSize) - 1;
+    if (sum->added != full) {
+        return 0;
+    }
+    enc->group = group;
+    return sum->parity;
+}
+
+const uint8_t *fecParity(const FecEncoder *enc, int index){
+    const FecSum *sum = &enc->sums[(enc->group / enc->groupSize) % enc->slots];
+    return sum->sums + (size_t)index * (FEC_HEADER_SIZE + enc->bufSize);
+}
+
+void fecLoss(FecEncoder *enc){
+    enc->losses++;
+}
+
+void fecRepaired(FecEncoder *enc, uint32_t total){
+    // RRs can arrive out of order; an older count is no news
+    if ((int32_t)(total - enc->repairedTotal) > 0) {
+        enc->repaired += total - enc->repairedTotal;
+        enc->repairedTotal = total;
+    }
+}
+
+// Sets K for the group from the losses since the last one began: one more
+// parity packet after a resend, the same after losses parity repaired, one
+// fewer after FEC_DECAY_GROUPS groups without either.
+static void startGroup(FecEncoder *enc, FecSum *sum, uint64_t group){
+    uint8_t before = enc->parity;
+    if (enc->losses > 0) {
+        enc->cleanGroups = 0;
+        if (enc->parity < enc->maxParity) {
+            enc->parity++;
+        }
+    } else if (enc->repaired > 0) {
+        enc->cleanGroups = 0;
+    } else if (++enc->cleanGroups >= FEC_DECAY_GROUPS) {
+        enc->cleanGroups = 0;
+        if (enc->parity > 1) {
+            enc->parity--;
+        }
+    }
+    if (enc->parity != before) {
+        printf("FEC: %u parity packets per %u after %u resends, %u repaired\n", enc->parity, enc->groupSize,
+               enc->losses, enc->repaired);
+    }
+    enc->losses = 0;
+    enc->repaired = 0;
+
+    sum->group = group;
+    sum->parity = enc->parity;
+    sum->added = 0;
+    memset(sum->sums, 0, (size_t)sum->parity * (FEC_HEADER_SIZE + enc->bufSize));
+    for (int j = 0; j < sum->parity; j++) {
+        uint8_t *payload = sum->sums + (size_t)j * (FEC_HEADER_SIZE + enc->bufSize);
+        payload[0] = j;
+        payload[1] = sum->parity;
+    }
+}
+
+// ----- Decoder -----
+void initFecDecoder(FecDecoder *dec, uint16_t groupSize, uint8_t maxParity, uint32_t bufSize, uint32_t windowSize){
+    memset(dec, 0, sizeof(FecDecoder));
+    dec->groupSize = groupSize;
+    dec->maxParity = maxParity;
+    dec->bufSize = bufSize;
+    dec->slots = windowSize / groupSize + 2;
+    dec->groups = sCalloc(dec->slots, sizeof(FecGroup));
+    dec->slab = sCalloc((size_t)dec->slots * maxParity, bufSize);
+    for (int i = 0; i < dec->slots; i++) {
+        dec->groups[i].group = MAX_INT_64;
+        dec->groups[i].parity = dec->slab + (size_t)i * maxParity * bufSize;
+    }
+}
+
+void freeFecDecoder(FecDecoder *dec){
+    if (dec->rebuilt > 0) {
+        printf("FEC: rebuilt %llu packets from parity\n", (unsigned long long)dec->rebuilt);
+    }
+    free(dec->groups);
+    free(dec->slab);
+    dec->groups = NULL;
+    dec->slab = NULL;
+}
+
+int fecStoreParity(FecDecoder *dec, uint64_t group, const uint8_t *payload, int len){
+    uint8_t index = payload[0];
+    uint8_t count = payload[1];
+    if (len != (int)(FEC_HEADER_SIZE + dec->bufSize) || group % dec->groupSize != 0 ||
+        count == 0 || count > dec->maxParity || index >= count) {
+        return -1;
+    }
+
+    FecGroup *g = &dec->groups[(group / dec->groupSize) % dec->slots];
+    if (g->group != group || g->count != count) {
+        g->group = group;
+        g->count = count;
+        g->have = 0;
+    }
+    memcpy(g->parity + (size_t)index * dec->bufSize, payload + FEC_HEADER_SIZE, dec->bufSize);
+    g->have |= 1 << index;
+    return 0;
+}
+
+int fecRecover(FecDecoder *dec, WindowBuffer *wb, uint64_t group, uint64_t expectedSeq){
+    FecGroup *g = &dec->groups[(group / dec->groupSize) % dec->slots];
+    if (g->group != group) {
+        return 0;
+    }
+
+    int rebuilt = 0;
+    for (int j = 0; j < g->count; j++) {
+        if (!(g->have & (1 << j))) {
+            continue;
+        }
+        // Exactly one missing, and room for it in the window
+        uint64_t missing = MAX_INT_64;
+        bool usable = true;
+        for (uint64_t seq = group + j; seq < group + dec->groupSize && usable; seq += g->count) {
+            if (wb->panes[seq % wb->window_size].seq_num == seq) {
+                continue;
+            }
+            usable = missing == MAX_INT_64 && seq >= expectedSeq && seq < expectedSeq + wb->window_size;
+            missing = seq;
+        }
+        if (!usable || missing == MAX_INT_64) {
+            continue;
+        }
+
+        pane *out = &wb->panes[missing % wb->window_size];
+        memcpy(out->data, g->parity + (size_t)j * dec->bufSize, dec->bufSize);
+        for (uint64_t seq = group + j; seq < group + dec->groupSize; seq += g->count) {
+            if (seq != missing) {
+                xorBytes(out->data, wb->panes[seq % wb->window_size].data, dec->bufSize);
+            }
+        }
+        out->seq_num = missing;
+        printf("FEC: rebuilt packet %llu from parity %d of group %llu\n",
+               (unsigned long long)missing, j, (unsigned long long)group);
+        dec->rebuilt++;
+        rebuilt++;
+    }
+    return rebuilt;
+}
+
+static void xorBytes(uint8_t *dst, const uint8_t *src, uint32_t len){
+    for (uint32_t i = 0; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "windowBuffer.h"
+
+// ----- Forward Error Correction -----
+// Data packets are taken in groups of N consecutive sequence numbers,
+// starting at a multiple of N. After a group's last packet the server
+// sends K parity packets (flag 17, seq = the group's first seq). Parity j
+// is the XOR of the group's packets whose position i has i % K == j, so a
+// group survives up to K losses as long as no two fall in the same class,
+// a burst of K included. The client rebuilds a missing pane from its
+// class's parity before asking for it, and reports how many it has rebuilt
+// at the end of every RR. K starts at 1 and adapts per group, up to the
+// negotiated maximum: resends show K was too low, repairs that it is just
+// enough. The group holding the EOF packet gets no parity.
+#define FEC_MAX_GROUP 64
+#define FEC_MAX_PARITY 8
+#define FEC_HEADER_SIZE 2      // parity payload: index, count, then the XOR of its packets
+#define FEC_DECAY_GROUPS 16    // groups without a loss before K comes down by one
+#define FEC_REPORT_SIZE 4      // RR trailer: packets the client has rebuilt so far, network order
+
+// One group's parity as it is being summed.
+typedef struct {
+    uint64_t group;        // MAX_INT_64 while empty
+    uint8_t parity;        // K the group is sent with
+    uint64_t added;        // bit i set once the group's packet i was summed
+    uint8_t *sums;         // maxParity parity payloads, FEC_HEADER_SIZE + bufSize apart
+} FecSum;
+
+// Blocks can be summed out of order (ring reads complete in any order), so
+// each group a window can span has its own sums.
+typedef struct {
+    uint16_t groupSize;    // N
+    uint8_t maxParity;
+    uint8_t parity;        // K for the next group started
+    uint32_t bufSize;
+    int slots;
+    FecSum *sums;
+    uint8_t *slab;
+    uint64_t group;        // first seq of the group fecEncode() last completed
+    uint32_t losses;       // packets the session had to resend since the last group began
+    uint32_t repaired;     // packets the client rebuilt meanwhile
+    uint32_t repairedTotal;   // the client's running count as last reported
+    int cleanGroups;
+} FecEncoder;
+
+// One group's parity packets as received.
+typedef struct {
+    uint64_t group;        // MAX_INT_64 while empty
+    uint8_t count;         // K the group was sent with
+    uint8_t have;          // bit j set once parity j arrived
+    uint8_t *parity;       // maxParity payloads of bufSize, header stripped
+} FecGroup;
+
+typedef struct {
+    uint16_t groupSize;
+    uint8_t maxParity;
+    uint32_t bufSize;
+    int slots;             // groups a window can span
+    FecGroup *groups;
+    uint8_t *slab;
+    uint64_t rebuilt;
+} FecDecoder;
+
+void initFecEncoder(FecEncoder *enc, uint16_t groupSize, uint8_t maxParity, uint32_t bufSize, uint32_t windowSize);
+void freeFecEncoder(FecEncoder *enc);
+
+// Sums the first transmission of a full data packet into its group, in any
+// order within the window. Returns the number of parity packets ready once
+// seq completes the group (enc->group), else 0. A group left incomplete
+// (the file ended) is dropped when a group a window later takes its slot.
+int fecEncode(FecEncoder *enc, uint64_t seq, const uint8_t *data);
+
+// Parity payload index of the group just completed, FEC_HEADER_SIZE + bufSize bytes.
+const uint8_t *fecParity(const FecEncoder *enc, int index);
+
+// The session resent a packet: the next group gets another parity packet.
+void fecLoss(FecEncoder *enc);
+
+// An RR reported total packets rebuilt by the client so far. Repairs keep K
+// where it is instead of letting it decay.
+void fecRepaired(FecEncoder *enc, uint32_t total);
+
+void initFecDecoder(FecDecoder *dec, uint16_t groupSize, uint8_t maxParity, uint32_t bufSize, uint32_t windowSize);
+void freeFecDecoder(FecDecoder *dec);
+
+// Keeps a received parity payload for the group starting at group.
+// Returns -1 if it doesn't fit the negotiated group and parity sizes.
+int fecStoreParity(FecDecoder *dec, uint64_t group, const uint8_t *payload, int len);
+
+// Rebuilds into wb each pane of the group that is the only one missing
+// from its parity class, if it lies between expectedSeq and the window's
+// edge. Panes below expectedSeq still count while they haven't been
+// overwritten. Returns the number rebuilt.
+int fecRecover(FecDecoder *dec, WindowBuffer *wb, uint64_t group, uint64_t expectedSeq);
+
+#endif
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "safeUtil.h"
+#include "handshakeCache.h"
+
+void initHandshakeCache(HandshakeCache *cache){
+    cache->count = 0;
+    cache->cap = HANDSHAKE_CACHE_SIZE;
+    cache->entries = sCalloc(cache->cap, sizeof(PendingHandshake));
+}
+
+PendingHandshake *findHandshake(HandshakeCache *cache, struct sockaddr_in6 *client, uint32_t nonce){
+    for (int i = 0; i < cache->count; i++) {
+        PendingHandshake *entry = &cache->entries[i];
+        if (sameHandshake(&entry->client, entry->nonce, client, nonce)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void rememberHandshake(HandshakeCache *cache, ChildContext *child){
+    if (child->nonce == 0) {
+        return;  // client can't be matched, nothing to dedupe against
+    }
+    if (cache->count == cache->cap) {
+        cache->cap *= 2;
+        cache->entries = srealloc(cache->entries, cache->cap * sizeof(PendingHandshake));
+    }
+
+    PendingHandshake *entry = &cache->entries[cache->count];
+    entry->socketNum = dup(child->socketNum);
+    if (entry->socketNum < 0) {
+        perror("dup");
+        return;
+    }
+    entry->client = child->client;
+    entry->nonce = child->nonce;
+    entry->sessionId = child->sessionId;
+    memcpy(entry->ackPayload, child->ackPayload, child->ackLen);
+    entry->ackLen = child->ackLen;
+    entry->expires = getTimeMs() + HANDSHAKE_TTL_MS;
+    cache->count++;
+}
+
+void expireHandshakes(HandshakeCache *cache){
+    uint64_t now = getTimeMs();
+    int i = 0;
+    while (i < cache->count) {
+        if (cache->entries[i].expires <= now) {
+            close(cache->entries[i].socketNum);
+            cache->entries[i] = cache->entries[--cache->count];
+        } else {
+            i++;
+        }
+    }
+}
+
+void closeHandshakeFds(HandshakeCache *cache){
+    for (int i = 0; i < cache->count; i++) {
+        close(cache->entries[i].socketNum);
+    }
+    cache->count = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef HANDSHAKECACHE_H
+#define HANDSHAKECACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "session.h"
+
+// How long the parent remembers an answered handshake: the whole period a
+// client keeps retrying its filename packet.
+#define HANDSHAKE_TTL_MS (MAX_ATTEMPTS * POLL_ONE_SEC)
+#define HANDSHAKE_CACHE_SIZE 16
+
+// A handshake already answered by the parent (fork and prefork modes). The
+// parent keeps its own copy of the session socket so duplicates are answered
+// from the same port the transfer runs on.
+typedef struct {
+    struct sockaddr_in6 client;
+    uint32_t nonce;
+    uint32_t sessionId;
+    int socketNum;
+    char ackPayload[MAX_ACK_PAYLOAD];
+    int ackLen;
+    uint64_t expires;
+} PendingHandshake;
+
+typedef struct {
+    PendingHandshake *entries;
+    int count;
+    int cap;
+} HandshakeCache;
+
+void initHandshakeCache(HandshakeCache *cache);
+
+// Returns the entry for this client address and nonce, or NULL.
+PendingHandshake *findHandshake(HandshakeCache *cache, struct sockaddr_in6 *client, uint32_t nonce);
+
+// Records an answered handshake. Duplicates child->socketNum, so the caller
+// may close its own descriptor.
+void rememberHandshake(HandshakeCache *cache, ChildContext *child);
+
+// Closes and drops entries past their TTL.
+void expireHandshakes(HandshakeCache *cache);
+
+// Closes every entry's socket and empties the cache. For a process forked
+// from the parent, which must not keep other sessions' ports bound.
+void closeHandshakeFds(HandshakeCache *cache);
+
+#endif
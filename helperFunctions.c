@@ -1,10 +1,35 @@
 #include "helperFunctions.h"
 #include "cpe464.h"     // For in_cksum()
 #include "safeUtil.h"   // For sendtoErr()
+#include "udpIo.h"      // For per-thread ErrorSim
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+// ----- Send Batch -----
+// Packets are built back to back: a full batch of default-size packets, or
+// fewer larger ones, the largest on its own.
+#define SEND_BATCH_BYTES (SEND_BATCH_MAX * MAX_PDU_SIZE)
+_Static_assert(SEND_BATCH_BYTES >= MAX_DATA_PDU_SIZE, "a send batch must hold the largest data packet");
+
+typedef struct {
+    int sock;
+    struct sockaddr_in6 dest;
+    int count;
+    bool inPlace;                     // iov points at the callers' buffers, sent zerocopy
+    uint32_t *marks[SEND_BATCH_MAX];  // inPlace: where each caller wants its zerocopy mark
+    struct iovec iov[SEND_BATCH_MAX];
+    size_t used;                      // bytes of packets taken
+    uint8_t packets[SEND_BATCH_BYTES];
+} PduBatch;
+
+static _Thread_local PduBatch pduBatch;
+static bool batchingEnabled = false;
 
 void printHexDump(const char *label, const char *buffer, int len) {
     if (label && label[0] != '\0')
@@ -20,45 +45,188 @@ void printHexDump(const char *label, const char *buffer, int len) {
 }
 
 int sendPdu(int sock, struct sockaddr_in6 *dest, pdu_header header, const char *payload, int payload_len) {
-    int header_size = sizeof(pdu_header);
-    int packet_len = header_size + payload_len;
-    char packet[MAX_PDU_SIZE];
-    
-    if(packet_len > MAX_PDU_SIZE) {
-        fprintf(stderr, "Error: packet length (%d) exceeds maximum (%d)\n", packet_len, MAX_PDU_SIZE);
-        return -1;	
-    }
-    
+    return sendSeqPdu(sock, dest, header, ntohl(header.seq), false, payload, payload_len);
+}
+
+// Sends a built packet through the thread's ErrorSim, or libcpe464.
+static int sendBuiltPdu(int sock, struct sockaddr_in6 *dest, uint8_t *packet, int packet_len) {
+    int destLen = sizeof(struct sockaddr_in6);
+    ErrorSim *sim = currentErrorSim();
+    int sent = sim ? simSendto(sim, sock, packet, packet_len, dest)
+                   : sendtoErr(sock, packet, packet_len, 0, (struct sockaddr *)dest, destLen);
+    if (sent < 0 && errno == EMSGSIZE && allowFragmentation(sock)) {
+        sent = sim ? simSendto(sim, sock, packet, packet_len, dest)
+                   : sendtoErr(sock, packet, packet_len, 0, (struct sockaddr *)dest, destLen);
+    }
+    if (sent < 0) {
+        perror("sendtoErr");
+        return -1;
+    }
+    return sent;
+}
+
+int sendSeqPdu(int sock, struct sockaddr_in6 *dest, pdu_header header, uint64_t seq, bool wide,
+               const char *payload, int payload_len) {
+    uint8_t packet[MAX_DATA_PDU_SIZE];
+
     // Ensure destination address is valid
     if (dest == NULL) {
         fprintf(stderr, "Error: Invalid destination address in sendPdu()\n");
         return -1;
     }
-    
-    // Create a local copy of the header.
-    pdu_header temp_header = header;
-    
-    // Copy header and payload into the packet.
-    memcpy(packet, &temp_header, header_size);
-    if (payload != NULL && payload_len > 0) {
-        memcpy(packet + header_size, payload, payload_len);
-    }
-    
-    // Compute checksum over the entire packet.
-    uint16_t cksum = in_cksum((unsigned short *)packet, packet_len);
-    temp_header.checksum = cksum;
-    memcpy(packet, &temp_header, header_size);
-    
+
+    int packet_len = buildSeqPdu(packet, header, seq, wide, payload, payload_len);
+    if (packet_len < 0) {
+        return -1;
+    }
+
     // Optionally print the hex dump.
-    // printHexDump("", packet, packet_len);
-    
-    int destLen = sizeof(struct sockaddr_in6);
-    int sent = sendtoErr(sock, packet, packet_len, 0, (struct sockaddr *)dest, destLen);
-    if (sent < 0) {
-        perror("sendtoErr");
+    // printHexDump("", (const char *)packet, packet_len);
+
+    return sendBuiltPdu(sock, dest, packet, packet_len);
+}
+
+void setPduBatching(bool enabled) {
+    batchingEnabled = enabled;
+}
+
+bool pduBatchingAllowed(void) {
+    return batchingEnabled || currentErrorSim() != NULL;
+}
+
+int queuePdu(int sock, struct sockaddr_in6 *dest, pdu_header header, const char *payload, int payload_len) {
+    return queueSeqPdu(sock, dest, header, ntohl(header.seq), false, payload, payload_len);
+}
+
+// Room for a len-byte packet to dest at the end of the batch, flushing
+// what's there first if it can't join it.
+static uint8_t *reserveBatch(int sock, struct sockaddr_in6 *dest, int len) {
+    PduBatch *batch = &pduBatch;
+    if (batch->count > 0 && (batch->inPlace || batch->sock != sock ||
+                             memcmp(&batch->dest, dest, sizeof(*dest)) != 0 ||
+                             batch->used + len > SEND_BATCH_BYTES)) {
+        flushPdus();
+    }
+    batch->sock = sock;
+    batch->dest = *dest;
+    return batch->packets + batch->used;
+}
+
+// Takes the len bytes reserveBatch() returned into the batch.
+static void commitBatch(int len) {
+    PduBatch *batch = &pduBatch;
+    batch->iov[batch->count].iov_base = batch->packets + batch->used;
+    batch->iov[batch->count].iov_len = len;
+    batch->used += len;
+    if (++batch->count == SEND_BATCH_MAX) {
+        flushPdus();
+    }
+}
+
+int queueSeqPdu(int sock, struct sockaddr_in6 *dest, pdu_header header, uint64_t seq, bool wide,
+                const char *payload, int payload_len) {
+    if (!pduBatchingAllowed()) {
+        return sendSeqPdu(sock, dest, header, seq, wide, payload, payload_len);
+    }
+
+    uint8_t *packet = reserveBatch(sock, dest, headerSize(wide) + payload_len);
+    int len = buildSeqPdu(packet, header, seq, wide, payload, payload_len);
+    if (len < 0) {
         return -1;
     }
-    return sent;
+    commitBatch(len);
+    return len;
+}
+
+int queuePduInPlace(int sock, struct sockaddr_in6 *dest, uint8_t *packet, int len, uint32_t *zcMark) {
+    ErrorSim *sim = currentErrorSim();
+    bool noErrors = sim == NULL || sim->error_rate == 0;
+    if (!pduBatchingAllowed() || !noErrors || !zeroCopyActive(sock)) {
+        // Copied like any other packet, so the buffer is free again at once
+        *zcMark = zeroCopyMark(sock);
+        if (!pduBatchingAllowed()) {
+            return sendBuiltPdu(sock, dest, packet, len);
+        }
+        memcpy(reserveBatch(sock, dest, len), packet, len);
+        commitBatch(len);
+        return len;
+    }
+
+    PduBatch *batch = &pduBatch;
+    if (batch->count > 0 && (!batch->inPlace || batch->sock != sock ||
+                             memcmp(&batch->dest, dest, sizeof(*dest)) != 0)) {
+        flushPdus();
+    }
+    batch->sock = sock;
+    batch->dest = *dest;
+    batch->inPlace = true;
+    batch->iov[batch->count].iov_base = packet;
+    batch->iov[batch->count].iov_len = len;
+    batch->marks[batch->count] = zcMark;
+    if (++batch->count == SEND_BATCH_MAX) {
+        flushPdus();
+    }
+    return len;
+}
+
+void flushPdus(void) {
+    PduBatch *batch = &pduBatch;
+    if (batch->count == 0) {
+        return;
+    }
+    if (batch->inPlace) {
+        batchSendto(NULL, batch->sock, batch->iov, batch->count, &batch->dest, true);
+        uint32_t mark = zeroCopyMark(batch->sock);
+        for (int i = 0; i < batch->count; i++) {
+            *batch->marks[i] = mark;
+        }
+    } else {
+        batchSendto(currentErrorSim(), batch->sock, batch->iov, batch->count, &batch->dest, false);
+    }
+    batch->count = 0;
+    batch->used = 0;
+    batch->inPlace = false;
+}
+
+int buildPdu(uint8_t *packet, pdu_header header, const char *payload, int payload_len) {
+    return buildSeqPdu(packet, header, ntohl(header.seq), false, payload, payload_len);
+}
+
+int buildSeqPdu(uint8_t *packet, pdu_header header, uint64_t seq, bool wide,
+                const char *payload, int payload_len) {
+    int header_len = headerSize(wide);
+    int packet_len = header_len + payload_len;
+    if (packet_len > (int)MAX_DATA_PDU_SIZE) {
+        fprintf(stderr, "Error: packet length (%d) exceeds maximum (%d)\n", packet_len, (int)MAX_DATA_PDU_SIZE);
+        return -1;
+    }
+    header.seq = htonl((uint32_t)seq);
+    header.checksum = 0;
+    memcpy(packet, &header, sizeof(pdu_header));
+    if (wide) {
+        uint32_t seqHigh = htonl((uint32_t)(seq >> 32));
+        memcpy(packet + sizeof(pdu_header), &seqHigh, SEQ_HIGH_SIZE);
+    }
+    if (payload != NULL && payload_len > 0) {
+        memcpy(packet + header_len, payload, payload_len);
+    }
+    header.checksum = in_cksum((unsigned short *)packet, packet_len);
+    memcpy(packet, &header, sizeof(pdu_header));
+    return packet_len;
+}
+
+int headerSize(bool wide) {
+    return wide ? WIDE_HEADER_SIZE : HEADER_SIZE;
+}
+
+uint64_t pduSeq(const uint8_t *packet, bool wide) {
+    uint32_t seq;
+    uint32_t seqHigh = 0;
+    memcpy(&seq, packet, sizeof(seq));
+    if (wide) {
+        memcpy(&seqHigh, packet + sizeof(pdu_header), SEQ_HIGH_SIZE);
+    }
+    return ((uint64_t)ntohl(seqHigh) << 32) | ntohl(seq);
 }
 
 int sendAck(int sock, struct sockaddr_in6 *dest, uint32_t seq, const char *ackPayload) {
@@ -66,6 +234,163 @@ int sendAck(int sock, struct sockaddr_in6 *dest, uint32_t seq, const char *ackPa
     ack.seq = htonl(seq);  // Use the given sequence number.
     ack.flag = 9;          // ACK flag.
     ack.checksum = 0;
+    ack.session = 0;
     int payload_len = (ackPayload != NULL) ? strlen(ackPayload) : 0;
     return sendPdu(sock, dest, ack, ackPayload, payload_len);
-}
\ No newline at end of file
+}
+
+int appendOption(uint8_t *buffer, int len, uint8_t type, const void *value, uint8_t valueLen) {
+    buffer[len++] = type;
+    buffer[len++] = valueLen;
+    if (valueLen > 0) {
+        memcpy(buffer + len, value, valueLen);
+    }
+    return len + valueLen;
+}
+
+int findOption(const uint8_t *buffer, int len, uint8_t type, void *value, uint8_t valueLen) {
+    int i = 0;
+    while (i + 2 <= len) {
+        uint8_t optType = buffer[i];
+        uint8_t optLen = buffer[i + 1];
+        if (i + 2 + optLen > len) {
+            break;
+        }
+        if (optType == type && optLen == valueLen) {
+            if (valueLen > 0) {
+                memcpy(value, buffer + i + 2, valueLen);
+            }
+            return 0;
+        }
+        i += 2 + optLen;
+    }
+    return -1;
+}
+
+int recvPdu(int sock, void *buffer, int len, struct sockaddr_in6 *src, socklen_t *srcLen) {
+    if (currentErrorSim()) {
+        return rawRecvfrom(sock, buffer, len, 0, src, srcLen);
+    }
+    return safeRecvfrom(sock, buffer, len, 0, (struct sockaddr *)src, (int *)srcLen);
+}
+
+int recvPdus(int sock, uint8_t (*buffers)[MAX_PDU_SIZE], int *lens, int max, struct sockaddr_in6 *srcs) {
+    return recvSizedPdus(sock, buffers[0], MAX_PDU_SIZE, lens, max, srcs);
+}
+
+int recvSizedPdus(int sock, uint8_t *buffers, int bufLen, int *lens, int max, struct sockaddr_in6 *srcs) {
+    reapZeroCopy(sock);   // an unread error queue keeps the socket polling ready
+    if (!pduBatchingAllowed()) {
+        socklen_t srcLen = sizeof(srcs[0]);
+        lens[0] = recvPdu(sock, buffers, bufLen, &srcs[0], &srcLen);
+        return 1;
+    }
+
+    struct iovec iov[RECV_BATCH_MAX];
+    if (max > RECV_BATCH_MAX) {
+        max = RECV_BATCH_MAX;
+    }
+    for (int i = 0; i < max; i++) {
+        iov[i].iov_base = buffers + (size_t)i * bufLen;
+        iov[i].iov_len = bufLen;
+    }
+    return batchRecvfrom(sock, iov, lens, max, srcs);
+}
+
+int recvCoalescedPdus(int sock, uint8_t (*buffers)[GRO_BUFFER_BYTES], int *lens, int *segs, int max, struct sockaddr_in6 *srcs) {
+    if (!pduBatchingAllowed()) {
+        socklen_t srcLen = sizeof(srcs[0]);
+        lens[0] = recvPdu(sock, buffers[0], GRO_BUFFER_BYTES, &srcs[0], &srcLen);
+        segs[0] = lens[0];
+        return 1;
+    }
+
+    struct iovec iov[GRO_BATCH_MAX];
+    if (max > GRO_BATCH_MAX) {
+        max = GRO_BATCH_MAX;
+    }
+    for (int i = 0; i < max; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = GRO_BUFFER_BYTES;
+    }
+    return batchRecvGro(sock, iov, lens, segs, max, srcs);
+}
+
+uint64_t getTimeMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t getTimeUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ----- Pace Timer -----
+int openPaceTimer(void) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+void armPaceTimer(int fd, uint64_t atUs) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = atUs / 1000000;
+    spec.it_value.tv_nsec = (atUs % 1000000) * 1000;
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+void clearPaceTimer(int fd) {
+    uint64_t expirations;
+    while (read(fd, &expirations, sizeof(expirations)) > 0)
+        ;
+}
+
+// ----- Retransmission Timeout -----
+void initRttEstimator(RttEstimator *rtt) {
+    memset(rtt, 0, sizeof(RttEstimator));
+    rtt->rtoMs = RTO_INITIAL_MS;
+}
+
+void addRttSample(RttEstimator *rtt, uint64_t sampleUs) {
+    if (!rtt->sampled) {
+        rtt->srttUs = sampleUs;
+        rtt->rttvarUs = sampleUs / 2;
+        rtt->sampled = true;
+    } else {
+        uint64_t err = sampleUs > rtt->srttUs ? sampleUs - rtt->srttUs : rtt->srttUs - sampleUs;
+        rtt->rttvarUs = (3 * rtt->rttvarUs + err) / 4;      // beta = 1/4
+        rtt->srttUs = (7 * rtt->srttUs + sampleUs) / 8;     // alpha = 1/8
+    }
+
+    uint64_t rtoMs = (rtt->srttUs + 4 * rtt->rttvarUs + 999) / 1000;
+    if (rtoMs < RTO_MIN_MS) {
+        rtoMs = RTO_MIN_MS;
+    } else if (rtoMs > RTO_MAX_MS) {
+        rtoMs = RTO_MAX_MS;
+    }
+    rtt->rtoMs = (uint32_t)rtoMs;
+    rtt->backoff = 0;
+}
+
+void backoffRto(RttEstimator *rtt) {
+    if ((rtt->rtoMs << rtt->backoff) < RTO_MAX_MS) {
+        rtt->backoff++;
+    }
+}
+
+void clearRtoBackoff(RttEstimator *rtt) {
+    rtt->backoff = 0;
+}
+
+uint32_t currentRto(const RttEstimator *rtt) {
+    uint32_t rto = rtt->rtoMs << rtt->backoff;
+    return rto < RTO_MAX_MS ? rto : RTO_MAX_MS;
+}
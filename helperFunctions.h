@@ -2,25 +2,67 @@
 #define HELPER_FUNCTIONS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "udpIo.h"
+#include "windowBuffer.h"
+
 // Define the PDU header structure.
+// seq and flag must stay at offsets 0 and 6, libcpe464 reads them there.
 typedef struct __attribute__((packed)) {
     uint32_t seq;
     uint16_t checksum;
     uint8_t flag;
+    uint32_t session;   // server-assigned session ID, 0 before the handshake is answered
 } pdu_header;
 
+// The wide header (HS_OPT_SEQ64) of a session whose file needs more packets
+// than 32 bits number: base.seq holds the low half of the sequence number.
+typedef struct __attribute__((packed)) {
+    pdu_header base;
+    uint32_t seqHigh;
+} pdu_wide_header;
+
 #define HEADER_SIZE sizeof(pdu_header)
-#define MAX_PDU_SIZE 1407
+#define WIDE_HEADER_SIZE sizeof(pdu_wide_header)
+#define SEQ_HIGH_SIZE (WIDE_HEADER_SIZE - HEADER_SIZE)
+#define COMPACT_SEQ_LIMIT 0xFFFFFFFFull   // packets, EOF included, the compact header can number
+#define MAX_PDU_SIZE 1411   // handshake and control packets, and the data packets of the default payload
 #define MAX_PAYLOAD 1400
+#define MAX_DATA_PDU_SIZE (WIDE_HEADER_SIZE + MAX_BUFFER)   // data packets of the largest payload a session negotiates
 #define MAXBUF 1400
 #define MAX_FILENAME 100
 #define POLL_TIMEOUT 1000
 #define POLL_ONE_SEC 1000
 #define POLL_TEN_SEC 10000
 #define MAX_ATTEMPTS 10
+#define MAX_BUSY_RETRIES 60   // "Busy" handshake answers a client sits through
+
+// Handshake options, appended as type/length/value after the filename in the
+// flag-8 request and after the status string's NUL in the flag-9 ACK
+#define HS_OPT_NONCE 1      // uint32_t client-chosen session nonce
+#define HS_OPT_RETRY_MS 2   // uint32_t in a "Busy" ACK: ms to wait before retrying
+#define HS_OPT_WINDOW 3     // uint32_t in an "Ok" ACK: window size the server granted
+#define HS_OPT_SACK 4       // empty: the client sends, or the server accepts, SACK RRs
+#define HS_OPT_ACK_FREQ 5   // uint16_t packets, uint16_t ms: the client's delayed-ack policy,
+                            // echoed by the server with the values it accepts
+#define HS_OPT_PAYLOAD 6    // uint32_t in an "Ok" ACK: data payload size the server granted
+#define HS_OPT_SEQ64 7      // empty: the client takes, or the server sends, wide headers
+#define HS_OPT_FEC 8        // empty from the client, which can rebuild packets from parity;
+                            // uint16_t group size, uint16_t max parity packets from the server
+
+// Delayed acks (HS_OPT_ACK_FREQ): in-order data is answered by one RR per
+// that many packets, or that many ms after the first unanswered one,
+// whichever comes first. Anything out of order is still answered at once.
+#define ACK_EVERY_MAX 64
+#define ACK_DELAY_MAX_MS 25
+
+// A SACK RR's payload is a bitmap of the packets held above its cumulative
+// ack: bit i (LSB first) set means seq + 1 + i arrived. Trailing zero bytes
+// are left off, so an RR with no holes carries none.
+#define SACK_MAX_BYTES 1024
 
 // Print a hex dump of a buffer.
 void printHexDump(const char *label, const char *buffer, int len);
@@ -28,12 +70,119 @@ void printHexDump(const char *label, const char *buffer, int len);
 // Assemble and send a PDU packet. Returns the number of bytes sent, or -1 on error.
 int sendPdu(int sock, struct sockaddr_in6 *dest, pdu_header header, const char *payload, int payload_len);
 
+// Writes header, payload and checksum into packet and returns its length.
+// payload may be NULL when payload_len bytes are already in place after the
+// header, e.g. read there straight from the file.
+int buildPdu(uint8_t *packet, pdu_header header, const char *payload, int payload_len);
+
+// Header bytes of a compact or wide PDU.
+int headerSize(bool wide);
+
+// The full sequence number of a received PDU with a compact or wide header.
+uint64_t pduSeq(const uint8_t *packet, bool wide);
+
+// buildPdu() with the sequence number seq in a compact or wide header,
+// header.seq aside. A NULL payload is already at packet + headerSize(wide).
+int buildSeqPdu(uint8_t *packet, pdu_header header, uint64_t seq, bool wide,
+                const char *payload, int payload_len);
+
+// sendPdu() and queuePdu() with buildSeqPdu()'s header.
+int sendSeqPdu(int sock, struct sockaddr_in6 *dest, pdu_header header, uint64_t seq, bool wide,
+               const char *payload, int payload_len);
+int queueSeqPdu(int sock, struct sockaddr_in6 *dest, pdu_header header, uint64_t seq, bool wide,
+                const char *payload, int payload_len);
+
+// Batched sends. queuePdu() builds the packet into a per-thread batch that
+// goes out with sendmmsg() when it fills, when the destination changes or on
+// flushPdus(). Batching needs sends that don't go through sendtoErr(): the
+// thread has an ErrorSim bound, or setPduBatching(true) was called because
+// there is no error simulation. Otherwise queuePdu() is sendPdu().
+void setPduBatching(bool enabled);
+int  queuePdu(int sock, struct sockaddr_in6 *dest, pdu_header header, const char *payload, int payload_len);
+void flushPdus(void);
+
+// queuePdu() for a packet already built in a buffer the caller keeps, such
+// as a window pane. With zerocopy on (setZeroCopy()) it is sent from there
+// with MSG_ZEROCOPY, and when the batch goes out *zcMark is set to the mark
+// the buffer must reach in zeroCopyDone() before it is written again.
+// Otherwise it is copied into the batch, and *zcMark only waits for the
+// zerocopy sends that went before it.
+int  queuePduInPlace(int sock, struct sockaddr_in6 *dest, uint8_t *packet, int len, uint32_t *zcMark);
+
 // Send an ACK packet with flag 9 (with a payload such as "Ok" or "Not Ok").
 // Returns the number of bytes sent, or -1 on error.
 int sendAck(int sock, struct sockaddr_in6 *dest, uint32_t seq, const char *ackPayload);
 
+// Receive one PDU. Goes through libcpe464 unless the calling thread has an
+// ErrorSim bound (see udpIo.h). Returns the number of bytes received.
+int recvPdu(int sock, void *buffer, int len, struct sockaddr_in6 *src, socklen_t *srcLen);
+
+// Receives every PDU already queued on a readable socket, up to max, with
+// one recvmmsg(). Like queuePdu() this needs the thread's ErrorSim or
+// setPduBatching(true); otherwise it receives one PDU through libcpe464.
+// Returns the number of PDUs in buffers/lens/srcs.
+int recvPdus(int sock, uint8_t (*buffers)[MAX_PDU_SIZE], int *lens, int max, struct sockaddr_in6 *srcs);
+
+// recvPdus() into max buffers of bufLen bytes each, laid out back to back,
+// for data packets that may be larger than MAX_PDU_SIZE.
+int recvSizedPdus(int sock, uint8_t *buffers, int bufLen, int *lens, int max, struct sockaddr_in6 *srcs);
+
+// recvPdus() for a socket with UDP_GRO on (see enableUdpGro()). Buffer i
+// holds lens[i] bytes of PDUs back to back, each segs[i] bytes except
+// possibly the last. Same batching rules as recvPdus(); without batching it
+// receives one PDU and reports segs[0] = lens[0].
+int recvCoalescedPdus(int sock, uint8_t (*buffers)[GRO_BUFFER_BYTES], int *lens, int *segs, int max, struct sockaddr_in6 *srcs);
+
+// True when queuePdu()/recvPdus() may bypass libcpe464 on this thread.
+bool pduBatchingAllowed(void);
+
 int validateChecksum(uint8_t *buffer, int dataLen); 
 
+// Append a type/length/value option at buffer + len. Returns the new length.
+int appendOption(uint8_t *buffer, int len, uint8_t type, const void *value, uint8_t valueLen);
+
+// Copy the value of option type into value. Returns 0 if found with exactly
+// valueLen bytes. Flag options have no value: pass NULL and 0.
+int findOption(const uint8_t *buffer, int len, uint8_t type, void *value, uint8_t valueLen);
+
+// Monotonic clock in milliseconds, used for per-session retransmit timers.
+uint64_t getTimeMs(void);
+
+// Same clock in microseconds, for RTT samples on sub-millisecond paths.
+uint64_t getTimeUs(void);
+
+// ----- Pace Timer -----
+// A timerfd on the getTimeUs() clock, for the sub-millisecond waits between
+// paced packets that poll() and epoll_wait() timeouts can't express. It
+// polls readable once armed time has passed, until cleared.
+int  openPaceTimer(void);
+void armPaceTimer(int fd, uint64_t atUs);   // absolute getTimeUs() time, 0 disarms
+void clearPaceTimer(int fd);
+
+// ----- Retransmission Timeout -----
+// RFC 6298: SRTT and RTTVAR from RTT samples taken under Karn's rule (never
+// from a retransmitted packet), RTO = SRTT + 4 * RTTVAR clamped to
+// [RTO_MIN_MS, RTO_MAX_MS], doubled on each timeout until the next sample.
+#define RTO_INITIAL_MS 1000   // until the first sample, as the fixed timer was
+#define RTO_MIN_MS 20
+#define RTO_MAX_MS 3000       // keeps MAX_ATTEMPTS backed-off timeouts under half a minute
+
+typedef struct {
+    uint64_t srttUs;
+    uint64_t rttvarUs;
+    uint32_t rtoMs;       // before backoff
+    int backoff;          // timeouts since the last sample
+    bool sampled;
+} RttEstimator;
+
+void initRttEstimator(RttEstimator *rtt);
+void addRttSample(RttEstimator *rtt, uint64_t sampleUs);
+void backoffRto(RttEstimator *rtt);
+void clearRtoBackoff(RttEstimator *rtt);
+
+// Current timeout in ms, backoff included.
+uint32_t currentRto(const RttEstimator *rtt);
+
 
 
 
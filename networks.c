@@ -176,6 +176,76 @@ int udpServerSetup(int serverPort)
 	
 }
 
+// Same as udpServerSetup() but sets SO_REUSEPORT first, so several sockets
+// (one per worker thread) can bind the same port and the kernel spreads
+// clients across them. Returns the socket number.
+
+int udpServerSetupReusePort(int serverPort)
+{
+	struct sockaddr_in6 serverAddress;
+	int socketNum = 0;
+	int on = 1;
+	socklen_t serverAddrLen = 0;
+
+	if ((socketNum = socket(AF_INET6,SOCK_DGRAM,0)) < 0)
+	{
+		perror("socket() call error");
+		exit(-1);
+	}
+
+	if (setsockopt(socketNum, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+	{
+		perror("setsockopt(SO_REUSEPORT) call error");
+		exit(-1);
+	}
+
+	memset(&serverAddress, 0, sizeof(struct sockaddr_in6));
+	serverAddress.sin6_family = AF_INET6;
+	serverAddress.sin6_addr = in6addr_any;
+	serverAddress.sin6_port = htons(serverPort);
+
+	if (bind(socketNum,(struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0)
+	{
+		perror("bind() call error");
+		exit(-1);
+	}
+
+	serverAddrLen = sizeof(serverAddress);
+	getsockname(socketNum,(struct sockaddr *) &serverAddress, &serverAddrLen);
+	printf("Server using Port #: %d (SO_REUSEPORT)\n", ntohs(serverAddress.sin6_port));
+
+	return socketNum;
+}
+
+// Opens a UDP socket bound to an OS-chosen port for one transfer session.
+// Returns the socket number or -1 on error (the caller keeps running).
+
+int udpSessionSetup(void)
+{
+	struct sockaddr_in6 sessionAddress;
+	int socketNum = 0;
+
+	if ((socketNum = socket(AF_INET6, SOCK_DGRAM, 0)) < 0)
+	{
+		perror("socket() call error");
+		return -1;
+	}
+
+	memset(&sessionAddress, 0, sizeof(struct sockaddr_in6));
+	sessionAddress.sin6_family = AF_INET6;
+	sessionAddress.sin6_addr = in6addr_any;
+	sessionAddress.sin6_port = 0;
+
+	if (bind(socketNum, (struct sockaddr *) &sessionAddress, sizeof(sessionAddress)) < 0)
+	{
+		perror("bind() call error");
+		close(socketNum);
+		return -1;
+	}
+
+	return socketNum;
+}
+
 // This function opens a socket and fills in the serverAdress structure using the hostName and serverPort.  
 // It assumes the address structure is created before calling this.
 // Returns the socket number and the filled in serverAddress struct.
@@ -27,6 +27,8 @@ int tcpClientSetup(char * serverName, char * serverPort, int debugFlag);
 
 // For UDP Server and Client
 int udpServerSetup(int serverPort);
+int udpServerSetupReusePort(int serverPort);
+int udpSessionSetup(void);
 int setupUdpClientToServer(struct sockaddr_in6 *serverAddress, char * hostName, int serverPort);
 
 #endif
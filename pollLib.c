@@ -14,6 +14,7 @@
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 
 #include "safeUtil.h"
 #include "pollLib.h"
@@ -72,7 +73,10 @@ int pollCall(int timeInMilliSeconds)
 	int returnValue = -1;
 	int pollValue = 0;
 	
-	if ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds)) < 0)
+	// io_uring completions can interrupt the wait, that is not an error
+	while ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds)) < 0 && errno == EINTR)
+		;
+	if (pollValue < 0)
 	{
 		perror("pollCall");
 		exit(-1);
@@ -11,6 +11,7 @@
 #include <arpa/inet.h>
 #include <math.h>
 #include <stdbool.h>
+#include <time.h>
 
 
 #include "gethostbyname.h"
@@ -20,6 +21,18 @@
 #include "pollLib.h"
 #include "windowBuffer.h"
 #include "helperFunctions.h"
+#include "udpIo.h"
+#include "fec.h"
+
+#define ACK_EVERY_DEFAULT 8       // proposed in HS_OPT_ACK_FREQ, -d overrides
+#define ACK_DELAY_DEFAULT_MS 1
+#define FEC_HOLD_MIN_MS 1        // least time a hole waits for its group's parity
+
+// What a received packet asks of the ack policy, strongest last
+#define ACK_NONE 0      // EOF (answered on its own) or another session's packet
+#define ACK_DELAYED 1   // in order: may wait for ackEvery packets or the ack delay
+#define ACK_NOW 2       // duplicate, or a hole just filled: the server is waiting on it
+#define ACK_LOSS 3      // hole, corrupt or outside the window: SREJ or SACK right away
 
 // ----- Rcopy FSM States ----- 
 typedef enum {
@@ -43,14 +56,29 @@ typedef struct {
     int portNumber;
     char *remoteMachine;
     int attempts;
+    int busyRetries;             // "Busy" answers, counted apart from lost packets
     bool ackReceived;
     bool eof; 
+    bool gro;                    // -g: receive GRO-coalesced data with UDP_GRO
+    bool sack;                   // server accepted SACK RRs in the handshake
+    bool wideSeq;                // server numbers this file with wide headers (HS_OPT_SEQ64)
+    uint16_t fecGroup;           // server sends parity per this many packets (HS_OPT_FEC), 0 if not
+    uint8_t fecParity;           // most parity packets per group
+    FecDecoder fec;
+    uint16_t ackEvery;           // delayed acks as proposed (-d), then as the server granted
+    uint16_t ackDelayMs;
+    int ackPending;              // in-order packets received since the last ack
+    uint64_t ackDeadline;        // when the pending ones must be acked, 0 if none pending
+    uint64_t holdDeadline;       // when a hole held back for parity is reported, 0 if none held
+    RttEstimator rtt;            // seeded by the handshake, times out the receive loop
+    uint32_t nonce;              // identifies this download across filename retransmits
+    uint32_t sessionId;          // assigned by the server in the handshake ACK
 } RcopyContext;
 
 typedef struct {
     FILE *outputFile;
     WindowBuffer buffer;
-    uint32_t expectedSeq;
+    uint64_t expectedSeq;
     int attempts;
     bool complete;
 } ReceiveState;
@@ -68,16 +96,25 @@ rcopy_state_t stateFileReceive(RcopyContext *rcopy);
 int checkArgs(int argc, char * argv[]);
 
 void rcopyFSM(RcopyContext *rcopy);
-void sendFilename(int socketNum, struct sockaddr_in6 *server, char* filename, int buffersize, int windowsize);
+void sendFilename(int socketNum, struct sockaddr_in6 *server, char* filename, int buffersize, int windowsize, uint32_t nonce,
+                  uint16_t ackEvery, uint16_t ackDelayMs);
 
 void initReceiveState(ReceiveState *state, int windowSize, int bufferSize, FILE *file); 
 bool receivePacket(RcopyContext *rcopy, ReceiveState *state); 
 bool handlePacketByType(RcopyContext *rcopy, ReceiveState *state, pdu_header *header, char *packet, int packetLen); 
-bool processDataPacket(RcopyContext *rcopy, ReceiveState *state, char *packet, int packetLen, uint32_t seq); 
-
-void sendRR(int RR, RcopyContext *rcopy); 
-void sendSREJ(int SREJ, RcopyContext *rcopy); 
-void sendEOF(uint32_t seqNum, RcopyContext *rcopy); 
+bool processDataPacket(RcopyContext *rcopy, ReceiveState *state, char *packet, int packetLen, uint64_t seq); 
+int  receiveCoalesced(RcopyContext *rcopy, WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq);
+int  placePacket(RcopyContext *rcopy, WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq, uint8_t *packet, int packetLen);
+int  placeParity(RcopyContext *rcopy, WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq, uint64_t group,
+                 uint8_t *payload, int len);
+void writeInOrder(WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq);
+
+void acknowledge(RcopyContext *rcopy, WindowBuffer *wb, uint64_t expectedSeq, bool loss);
+int  appendRepaired(RcopyContext *rcopy, char *payload, int len);
+void sendRR(uint64_t RR, RcopyContext *rcopy); 
+void sendSREJ(uint64_t SREJ, RcopyContext *rcopy); 
+void sendSack(uint64_t RR, WindowBuffer *wb, RcopyContext *rcopy);
+void sendEOF(uint64_t seqNum, RcopyContext *rcopy); 
 
 void cleanup(RcopyContext *rcopy);
 
@@ -89,6 +126,28 @@ int main(int argc, char *argv[])
 {
     RcopyContext rcopy;
     memset(&rcopy, 0, sizeof(RcopyContext));
+    rcopy.ackEvery = ACK_EVERY_DEFAULT;
+    rcopy.ackDelayMs = ACK_DELAY_DEFAULT_MS;
+
+    int opt;
+    unsigned every, delayMs;
+    while ((opt = getopt(argc, argv, "gd:")) != -1) {
+        if (opt == 'g') {
+            rcopy.gro = true;
+        } else if (opt == 'd' && sscanf(optarg, "%u:%u", &every, &delayMs) == 2 &&
+                   every >= 1 && every <= ACK_EVERY_MAX && delayMs <= ACK_DELAY_MAX_MS) {
+            rcopy.ackEvery = every;
+            rcopy.ackDelayMs = delayMs;
+        } else {
+            fprintf(stderr, "Usage: %s [-g] [-d packets:ms] <from-filename> <to-filename> <window-size> <buffer-size> <error-rate> <remote-machine> <remote-port>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Drop the options so the positional arguments start at argv[1] again
+    argv[optind - 1] = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
+
     rcopy.portNumber = checkArgs(argc, argv);
     rcopy.server_filename = argv[1];
     rcopy.rcopy_filename = argv[2];
@@ -96,6 +155,9 @@ int main(int argc, char *argv[])
     rcopy.buffersize = atoi(argv[4]);
     rcopy.error_rate = atof(argv[5]);  // Fix: Use atof instead of atoi for double values.
     rcopy.remoteMachine = argv[6];
+    srand(time(NULL) ^ getpid());
+    rcopy.nonce = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    if (rcopy.nonce == 0) rcopy.nonce = 1;  // 0 means "no nonce" to the server
 
     setupPollSet();  // Initialize poll set.
     rcopyFSM(&rcopy);
@@ -109,7 +171,7 @@ int checkArgs(int argc, char * argv[])
     
     /* Check command-line arguments */
     if (argc != 8) {
-        fprintf(stderr, "Usage: %s <from-filename> <to-filename> <window-size> <buffer-size> <error-rate> <remote-machine> <remote-port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-g] [-d packets:ms] <from-filename> <to-filename> <window-size> <buffer-size> <error-rate> <remote-machine> <remote-port>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -130,6 +192,11 @@ int checkArgs(int argc, char * argv[])
         fprintf(stderr, "Error: window-size '%s' is too large. Max allowed is 2 ^ 30.\n", argv[3]);
         exit(EXIT_FAILURE);
     }
+
+    if (atoi(argv[4]) < 1 || atoi(argv[4]) > MAX_BUFFER) {
+        fprintf(stderr, "Error: buffer-size '%s' must be between 1 and %d.\n", argv[4], MAX_BUFFER);
+        exit(EXIT_FAILURE);
+    }
 	
 	double errorRate = 0.0; 
     errorRate = atof(argv[5]); 
@@ -181,6 +248,8 @@ rcopy_state_t stateInit(RcopyContext *rcopy)
     rcopy->socketNum = setupUdpClientToServer(&rcopy->server, rcopy->remoteMachine, rcopy->portNumber);
     addToPollSet(rcopy->socketNum);
     sendErr_init(rcopy->error_rate, DROP_ON, FLIP_OFF, DEBUG_ON, RSEED_ON);
+    setPduBatching(rcopy->error_rate == 0);   // recvmmsg() only when nothing is simulated
+    initRttEstimator(&rcopy->rtt);
     return STATE_HANDSHAKE;
 }
 
@@ -198,59 +267,153 @@ rcopy_state_t stateHandshake(RcopyContext *rcopy)
     struct sockaddr_in6 src;
     socklen_t srcLen = sizeof(src);
 
-    while (rcopy->attempts < MAX_ATTEMPTS) {
+    // Retries reuse the same socket and nonce, so the server recognises them
+    // as the same download instead of starting another transfer.
+    while (rcopy->attempts < MAX_ATTEMPTS && rcopy->busyRetries < MAX_BUSY_RETRIES) {
+        uint32_t retryMs = 0;
         // Send filename packet.
-        sendFilename(rcopy->socketNum, &rcopy->server, rcopy->server_filename, rcopy->buffersize, rcopy->windowsize);
+        sendFilename(rcopy->socketNum, &rcopy->server, rcopy->server_filename, rcopy->buffersize, rcopy->windowsize, rcopy->nonce,
+                     rcopy->ackEvery, rcopy->ackDelayMs);
+        uint64_t sentUs = getTimeUs();
         printf("Handshake attempt %d...\n", rcopy->attempts + 1);
 
-         if (pollCall(POLL_ONE_SEC) >= 0) {
+        uint64_t deadline = getTimeMs() + POLL_ONE_SEC;
+        uint64_t now;
+        while ((now = getTimeMs()) < deadline && pollCall((int)(deadline - now)) >= 0) {
+            srcLen = sizeof(src);
             int pduLen = safeRecvfrom(rcopy->socketNum, pdu, MAX_PDU_SIZE, 0, (struct sockaddr *)&src, (int *)&srcLen);
-            if (pduLen > 0) {
-                // Read header from received data.
-                pdu_header header;
-                memcpy(&header, pdu, HEADER_SIZE);
-
-                switch (header.flag) {
-                    case 9:  // ACK flag
-                        printf("Received ACK from server.\n");
-
-                        int payload_len = pduLen - HEADER_SIZE;
-                        char ackPayload[MAX_PAYLOAD - HEADER_SIZE + 1] = {0};
-                        if (payload_len > 0) {
-                            memcpy(ackPayload, pdu + HEADER_SIZE, payload_len);
-                            ackPayload[payload_len] = '\0';
-                            printf("ACK Payload: \"%s\"\n", ackPayload);
+            if (pduLen < (int)HEADER_SIZE || in_cksum((unsigned short *)pdu, pduLen) != 0) {
+                printf("Corrupt packet during handshake. Ignoring.\n");
+                continue;
+            }
+
+            // Read header from received data.
+            pdu_header header;
+            memcpy(&header, pdu, HEADER_SIZE);
+
+            switch (header.flag) {
+                case 9:  // ACK flag
+                    printf("Received ACK from server.\n");
+
+                    int payload_len = pduLen - HEADER_SIZE;
+                    char ackPayload[MAX_PAYLOAD - HEADER_SIZE + 1] = {0};
+                    if (payload_len > 0) {
+                        memcpy(ackPayload, pdu + HEADER_SIZE, payload_len);
+                        ackPayload[payload_len] = '\0';
+                        printf("ACK Payload: \"%s\"\n", ackPayload);
+                    }
+
+                    if (strcmp(ackPayload, "Busy") == 0) {
+                        // Options follow the status string's NUL
+                        int optOffset = strlen(ackPayload) + 1;
+                        uint32_t netRetry = htonl(POLL_ONE_SEC);
+                        findOption((uint8_t *)ackPayload + optOffset, payload_len - optOffset,
+                                   HS_OPT_RETRY_MS, &netRetry, sizeof(netRetry));
+                        retryMs = ntohl(netRetry);
+                        deadline = now;   // stop waiting for this attempt
+                        break;
+                    }
+                    if (strcmp(ackPayload, "Ok") == 0) { 
+                        memcpy(&rcopy->server, &src, sizeof(struct sockaddr_in6));
+                        rcopy->sessionId = ntohl(header.session);
+                        printf("Session ID: %u\n", rcopy->sessionId);
+
+                        // Karn's rule: after a retry the ACK may answer an earlier request
+                        if (rcopy->attempts == 0 && rcopy->busyRetries == 0) {
+                            uint64_t rttUs = getTimeUs() - sentUs;
+                            addRttSample(&rcopy->rtt, rttUs);
+                            printf("Handshake RTT %.3f ms, RTO %u ms\n", rttUs / 1000.0, currentRto(&rcopy->rtt));
                         }
 
-                        if (strcmp(ackPayload, "Ok") == 0) { 
-                            memcpy(&rcopy->server, &src, sizeof(struct sockaddr_in6));
-                            uint16_t port = ntohs(rcopy->server.sin6_port);
-                            printf("Handshake successful! Proceeding to file reception at port: %u\n", port); 
-                            return STATE_FILE_RECEIVE;
-                        } 
-                        else { 
-                            perror("Server responded with 'Not Ok'. Terminating.\n");
-                            close(rcopy->socketNum); 
-                            exit(EXIT_FAILURE); 
+                        // The server may grant a smaller window than asked for
+                        int optOffset = strlen(ackPayload) + 1;
+                        uint32_t netWindow;
+                        if (optOffset < payload_len &&
+                            findOption((uint8_t *)ackPayload + optOffset, payload_len - optOffset,
+                                       HS_OPT_WINDOW, &netWindow, sizeof(netWindow)) == 0 &&
+                            ntohl(netWindow) > 0 && ntohl(netWindow) < (uint32_t)rcopy->windowsize) {
+                            printf("Server granted window %u (asked for %d)\n", ntohl(netWindow), rcopy->windowsize);
+                            rcopy->windowsize = ntohl(netWindow);
                         }
-                    default:
-                        printf("Unexpected packet (flag=%d) received. Ignoring.\n", header.flag);
-                        break;
-                }
+                        // ... and packets only as large as the path to us carries whole
+                        uint32_t netPayload;
+                        if (optOffset < payload_len &&
+                            findOption((uint8_t *)ackPayload + optOffset, payload_len - optOffset,
+                                       HS_OPT_PAYLOAD, &netPayload, sizeof(netPayload)) == 0 &&
+                            ntohl(netPayload) > 0 && ntohl(netPayload) < (uint32_t)rcopy->buffersize) {
+                            printf("Server granted buffer size %u (asked for %d)\n", ntohl(netPayload), rcopy->buffersize);
+                            rcopy->buffersize = ntohl(netPayload);
+                        }
+                        if (optOffset < payload_len &&
+                            findOption((uint8_t *)ackPayload + optOffset, payload_len - optOffset,
+                                       HS_OPT_SACK, NULL, 0) == 0) {
+                            printf("Server accepts selective acks\n");
+                            rcopy->sack = true;
+                        }
+                        if (optOffset < payload_len &&
+                            findOption((uint8_t *)ackPayload + optOffset, payload_len - optOffset,
+                                       HS_OPT_SEQ64, NULL, 0) == 0) {
+                            printf("File needs more than 2^32 packets, using 64-bit sequence numbers\n");
+                            rcopy->wideSeq = true;
+                        }
+                        uint16_t fec[2];
+                        if (optOffset < payload_len &&
+                            findOption((uint8_t *)ackPayload + optOffset, payload_len - optOffset,
+                                       HS_OPT_FEC, fec, sizeof(fec)) == 0 &&
+                            ntohs(fec[0]) >= 2 && ntohs(fec[0]) <= FEC_MAX_GROUP &&
+                            ntohs(fec[1]) >= 1 && ntohs(fec[1]) <= FEC_MAX_PARITY && ntohs(fec[1]) < ntohs(fec[0])) {
+                            rcopy->fecGroup = ntohs(fec[0]);
+                            rcopy->fecParity = ntohs(fec[1]);
+                            printf("FEC: up to %u parity packets per %u data packets\n", rcopy->fecParity, rcopy->fecGroup);
+                        }
+                        // Without the option back the server wants every batch acked
+                        uint16_t ackFreq[2];
+                        if (optOffset < payload_len &&
+                            findOption((uint8_t *)ackPayload + optOffset, payload_len - optOffset,
+                                       HS_OPT_ACK_FREQ, ackFreq, sizeof(ackFreq)) == 0 && ntohs(ackFreq[0]) >= 1) {
+                            rcopy->ackEvery = ntohs(ackFreq[0]);
+                            rcopy->ackDelayMs = ntohs(ackFreq[1]);
+                            printf("Delayed acks: one RR per %u packets or %u ms\n", rcopy->ackEvery, rcopy->ackDelayMs);
+                        } else {
+                            rcopy->ackEvery = 1;
+                            rcopy->ackDelayMs = 0;
+                        }
+                        uint16_t port = ntohs(rcopy->server.sin6_port);
+                        printf("Handshake successful! Proceeding to file reception at port: %u\n", port); 
+                        return STATE_FILE_RECEIVE;
+                    } 
+                    else { 
+                        fprintf(stderr, "Error: file %s not found\n", rcopy->server_filename);
+                        close(rcopy->socketNum); 
+                        exit(EXIT_FAILURE); 
+                    }
+                default:
+                    printf("Unexpected packet (flag=%d) received. Ignoring.\n", header.flag);
+                    break;
             }
         }
 
+        if (retryMs > 0) {
+            rcopy->busyRetries++;
+            printf("Server busy, retrying in %u ms (%d/%d)\n", retryMs, rcopy->busyRetries, MAX_BUSY_RETRIES);
+            // Waited out on the socket; a stale answer arriving meanwhile is dropped
+            uint64_t retryAt = getTimeMs() + retryMs;
+            while ((now = getTimeMs()) < retryAt && pollCall((int)(retryAt - now)) >= 0) {
+                srcLen = sizeof(src);
+                safeRecvfrom(rcopy->socketNum, pdu, MAX_PDU_SIZE, 0, (struct sockaddr *)&src, (int *)&srcLen);
+            }
+            continue;
+        }
+
         rcopy->attempts++;
         printf("No ACK received. Retrying handshake...\n");
-        close(rcopy->socketNum);
-        rcopy->socketNum = setupUdpClientToServer(&rcopy->server, rcopy->remoteMachine, rcopy->portNumber);
-        pollCall(POLL_ONE_SEC);  // Backoff delay.
     }
     printf("Max handshake attempts reached. Terminating.\n");
     return STATE_DONE;
 }
 
-void sendFilename(int socketNum, struct sockaddr_in6 *server, char* filename, int buffersize, int windowsize)
+void sendFilename(int socketNum, struct sockaddr_in6 *server, char* filename, int buffersize, int windowsize, uint32_t nonce,
+                  uint16_t ackEvery, uint16_t ackDelayMs)
 {
     char pdu[MAX_PDU_SIZE - HEADER_SIZE];
     int pduLen = 0;
@@ -270,11 +433,23 @@ void sendFilename(int socketNum, struct sockaddr_in6 *server, char* filename, in
     pdu[pduLen++] = filename_len;
     memcpy(pdu + pduLen, filename, filename_len);
     pduLen += filename_len;   
+
+    // ----- Options -----
+    uint32_t netNonce = htonl(nonce);
+    pduLen = appendOption((uint8_t *)pdu, pduLen, HS_OPT_NONCE, &netNonce, sizeof(netNonce));
+    pduLen = appendOption((uint8_t *)pdu, pduLen, HS_OPT_SACK, NULL, 0);
+    pduLen = appendOption((uint8_t *)pdu, pduLen, HS_OPT_SEQ64, NULL, 0);
+    pduLen = appendOption((uint8_t *)pdu, pduLen, HS_OPT_FEC, NULL, 0);
+    if (ackEvery > 1) {
+        uint16_t ackFreq[2] = {htons(ackEvery), htons(ackDelayMs)};
+        pduLen = appendOption((uint8_t *)pdu, pduLen, HS_OPT_ACK_FREQ, ackFreq, sizeof(ackFreq));
+    }
     
     pdu_header header;
     header.seq = htonl(0);
     header.flag = 8; 
     header.checksum = 0;
+    header.session = 0;
     
     int bytesSent = sendPdu(socketNum, server, header, pdu, pduLen);
     if (bytesSent < 0) {
@@ -295,96 +470,299 @@ rcopy_state_t stateFileReceive(RcopyContext *rcopy) {
     
     WindowBuffer wb;            init_window(&wb, rcopy->windowsize, rcopy->buffersize, NULL);
     
-    uint32_t expectedSeq = 0;   rcopy->attempts = 0;
+    uint64_t expectedSeq = 0;   rcopy->attempts = 0;
     
+    if(rcopy->fecGroup > 0) {
+        initFecDecoder(&rcopy->fec, rcopy->fecGroup, rcopy->fecParity, rcopy->buffersize, rcopy->windowsize);
+    }
+    
+    // Parity packets are the largest the server sends
+    int pduSize = headerSize(rcopy->wideSeq) + rcopy->buffersize + (rcopy->fecGroup > 0 ? FEC_HEADER_SIZE : 0);
+    uint8_t *packets = sCalloc(RECV_BATCH_MAX, pduSize);
+    int lens[RECV_BATCH_MAX];
+    struct sockaddr_in6 srcs[RECV_BATCH_MAX];
+
+    // A window of large packets overflows the default receive buffer long
+    // before the window is full; the kernel caps this at rmem_max
+    uint64_t window = (uint64_t)rcopy->windowsize * pduSize;
+    int rcvBuf = window < (1 << 30) ? (int)window : (1 << 30);
+    if(setsockopt(rcopy->socketNum, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf)) < 0) {
+        perror("setsockopt SO_RCVBUF");
+    }
+
+    // Only data arrives from here on, so a coalesced datagram can't land in
+    // the handshake's MAX_PDU_SIZE buffer
+    if(rcopy->gro) {
+        if(!pduBatchingAllowed()) {
+            printf("GRO needs an error rate of 0, -g ignored\n");
+            rcopy->gro = false;
+        } else if(enableUdpGro(rcopy->socketNum) != 0) {
+            rcopy->gro = false;
+        } else {
+            printf("UDP GRO enabled\n");
+        }
+    }
+
     while(!rcopy->eof && rcopy->attempts < MAX_ATTEMPTS) {
-        int pollResult = pollCall(POLL_ONE_SEC);
-        
+        // While a hole waits for parity the delayed ack waits with it, as
+        // its SACK would report the hole
+        int timeout = currentRto(&rcopy->rtt);
+        uint64_t now = getTimeMs();
+        uint64_t due = rcopy->holdDeadline != 0 ? rcopy->holdDeadline : rcopy->ackDeadline;
+        if(due != 0 && (int)(due - now) < timeout) {
+            timeout = due > now ? (int)(due - now) : 0;
+        }
+        int pollResult = pollCall(timeout);
+
+        if(pollResult <= 0 && due != 0 && getTimeMs() >= due) {
+            // The ack delay ran out, or the parity was lost or never sent; not the server
+            if(rcopy->holdDeadline != 0) {
+                printf("Parity for seq %llu overdue, reporting the hole\n", (unsigned long long)expectedSeq);
+            }
+            acknowledge(rcopy, &wb, expectedSeq, rcopy->holdDeadline != 0);
+            continue;
+        }
         if(pollResult <= 0) {
             rcopy->attempts++;
-            printf("Timeout %d/%d\n", rcopy->attempts, MAX_ATTEMPTS);
-            sendRR(expectedSeq, rcopy); // Resend current RR on timeout
+            backoffRto(&rcopy->rtt);
+            printf("Timeout %d/%d, RTO now %u ms\n", rcopy->attempts, MAX_ATTEMPTS, currentRto(&rcopy->rtt));
+            acknowledge(rcopy, &wb, expectedSeq, false); // Resend current RR on timeout
             continue;
         }
         rcopy->attempts = 0;
+        clearRtoBackoff(&rcopy->rtt);
         
-        // Receive and check packet
-        char packet[MAX_PDU_SIZE];
-        struct sockaddr_in6 src;
-        socklen_t srcLen = sizeof(src);
-        int packetLen = safeRecvfrom(rcopy->socketNum, packet, MAX_PDU_SIZE, 0, (struct sockaddr*)&src, (int*)&srcLen);
-        
-        if(packetLen < 0 || in_cksum((uint16_t*)packet, packetLen) != 0) {
-            sendSREJ(expectedSeq, rcopy);
+        // Everything already queued is placed first, then the batch gets a
+        // single RR, or a single SREJ if it left a hole below the window edge.
+        // With SACK the RR itself lists what arrived above the hole. In-order
+        // data may wait for ackEvery packets or the ack delay instead.
+        int ack = ACK_NONE;
+        if(rcopy->gro) {
+            ack = receiveCoalesced(rcopy, &wb, outputFile, &expectedSeq);
+        } else {
+            int count = recvSizedPdus(rcopy->socketNum, packets, pduSize, lens, RECV_BATCH_MAX, srcs);
+            for(int i = 0; i < count && !rcopy->eof; i++) {
+                int want = placePacket(rcopy, &wb, outputFile, &expectedSeq, packets + (size_t)i * pduSize, lens[i]);
+                if(want > ack) ack = want;
+            }
+        }
+        if(rcopy->holdDeadline != 0 && getTimeMs() >= rcopy->holdDeadline) {
+            ack = ACK_LOSS;   // data kept coming, but not the parity
+        }
+
+        if(rcopy->eof || ack == ACK_NONE) {
             continue;
         }
-        
-        // Process packet
-        pdu_header header;
-        memcpy(&header, packet, HEADER_SIZE);
-        uint32_t seqNum = ntohl(header.seq);
-        
-        if(header.flag == 10) { // EOF
-            if(seqNum == expectedSeq) {
-                printf("EOF received and acknowledged\n");
-                fwrite(packet + HEADER_SIZE, 1, packetLen - HEADER_SIZE, outputFile);
-                sendEOF(seqNum, rcopy);
-                rcopy->eof = true;
-            } else {
-                sendSREJ(expectedSeq, rcopy);
-            }
+        if(ack >= ACK_NOW || rcopy->ackPending >= rcopy->ackEvery) {
+            acknowledge(rcopy, &wb, expectedSeq, ack == ACK_LOSS);
+        } else if(rcopy->ackDeadline == 0) {
+            rcopy->ackDeadline = getTimeMs() + rcopy->ackDelayMs;
+        }
+    }
+    fclose(outputFile);     free_window(&wb);       free(packets);
+    if(rcopy->fecGroup > 0) freeFecDecoder(&rcopy->fec);
+    return STATE_DONE;
+}
+
+// Receives a batch of possibly GRO-coalesced datagrams and splits each back
+// into PDUs by the segment size the kernel reported. Returns the ack the
+// batch calls for, as placePacket() does.
+int receiveCoalesced(RcopyContext *rcopy, WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq) {
+    static uint8_t buffers[GRO_BATCH_MAX][GRO_BUFFER_BYTES];
+    int lens[GRO_BATCH_MAX];
+    int segs[GRO_BATCH_MAX];
+    struct sockaddr_in6 srcs[GRO_BATCH_MAX];
+
+    int count = recvCoalescedPdus(rcopy->socketNum, buffers, lens, segs, GRO_BATCH_MAX, srcs);
+    int ack = ACK_NONE;
+    for(int i = 0; i < count && !rcopy->eof; i++) {
+        for(int offset = 0; offset < lens[i] && !rcopy->eof; offset += segs[i]) {
+            int len = lens[i] - offset < segs[i] ? lens[i] - offset : segs[i];
+            int want = placePacket(rcopy, wb, outputFile, expectedSeq, buffers[i] + offset, len);
+            if(want > ack) ack = want;
         }
-        else if(seqNum >= expectedSeq && seqNum < expectedSeq + rcopy->windowsize) {
-            uint32_t index = seqNum % wb.window_size;
-            wb.panes[index].seq_num = seqNum;
-            memcpy(wb.panes[index].data, packet + HEADER_SIZE, packetLen - HEADER_SIZE);
-            
-            // Process all contiguous packets
-            if(seqNum == expectedSeq) {
-                // Write current packet and all consecutive buffered packets
-                while(wb.panes[expectedSeq % wb.window_size].seq_num == expectedSeq) {
-                    printf("Writing packet %u to file\n", expectedSeq);
-                    fwrite(wb.panes[expectedSeq % wb.window_size].data, 1, wb.buffer_size, outputFile);
-                    expectedSeq++;
-                }
-                sendRR(expectedSeq, rcopy);
-            } else {
-                // Out-of-order packet - request missing packet
-                printf("Out-of-order packet %u, expecting %u\n", seqNum, expectedSeq);
-                sendSREJ(expectedSeq, rcopy);
+    }
+    return ack;
+}
+
+// Checks one received packet and puts it in its window slot, writing out
+// whatever became contiguous. Returns the ack it calls for, ACK_NONE to
+// ACK_LOSS (an EOF is answered here).
+int placePacket(RcopyContext *rcopy, WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq, uint8_t *packet, int packetLen) {
+    int hdrLen = headerSize(rcopy->wideSeq);
+    if(packetLen < hdrLen || in_cksum((uint16_t*)packet, packetLen) != 0) {
+        return ACK_LOSS;
+    }
+
+    pdu_header header;
+    memcpy(&header, packet, HEADER_SIZE);
+    uint64_t seqNum = pduSeq(packet, rcopy->wideSeq);
+
+    if(ntohl(header.session) != rcopy->sessionId) {
+        printf("Packet for session %u, not ours (%u). Ignoring.\n", ntohl(header.session), rcopy->sessionId);
+        return ACK_NONE;
+    }
+
+    if(header.flag == 10) { // EOF
+        if(seqNum != *expectedSeq) {
+            return ACK_LOSS;
+        }
+        printf("EOF received and acknowledged\n");
+        fwrite(packet + hdrLen, 1, packetLen - hdrLen, outputFile);
+        sendEOF(seqNum, rcopy);
+        rcopy->eof = true;
+        return ACK_NONE;
+    }
+
+    if(header.flag == 17) { // parity
+        return placeParity(rcopy, wb, outputFile, expectedSeq, seqNum, packet + hdrLen, packetLen - hdrLen);
+    }
+
+    if(seqNum < *expectedSeq) {
+        printf("Duplicate packet %llu\n", (unsigned long long)seqNum);
+        return ACK_NOW;
+    }
+    if(seqNum >= *expectedSeq + rcopy->windowsize) {
+        printf("Packet %llu outside window\n", (unsigned long long)seqNum);
+        return ACK_LOSS;
+    }
+
+    if(packetLen - hdrLen > (int)wb->buffer_size) {
+        printf("Packet %llu larger than the buffer size\n", (unsigned long long)seqNum);
+        return ACK_LOSS;
+    }
+    uint32_t index = seqNum % wb->window_size;
+    wb->panes[index].seq_num = seqNum;
+    memcpy(wb->panes[index].data, packet + hdrLen, packetLen - hdrLen);
+
+    // The group's parity may have come first
+    if(rcopy->fecGroup > 0) {
+        fecRecover(&rcopy->fec, wb, seqNum - seqNum % rcopy->fecGroup, *expectedSeq);
+    }
+
+    uint64_t before = *expectedSeq;
+    writeInOrder(wb, outputFile, expectedSeq);
+    if(*expectedSeq == before) {
+        printf("Out-of-order packet %llu, expecting %llu\n", (unsigned long long)seqNum, (unsigned long long)before);
+        // A hole the parity after its group may still fill is reported
+        // once packets past the group arrive instead, or after half a round
+        // trip if the parity doesn't come (it was lost, or this is the EOF
+        // group, which has none)
+        if(rcopy->fecGroup > 0 && seqNum < before - before % rcopy->fecGroup + rcopy->fecGroup) {
+            if(rcopy->holdDeadline == 0) {
+                uint64_t holdMs = rcopy->rtt.srttUs / 2000;
+                rcopy->holdDeadline = getTimeMs() + (holdMs > FEC_HOLD_MIN_MS ? holdMs : FEC_HOLD_MIN_MS);
             }
-        } else if(seqNum < expectedSeq) {
-            printf("Duplicate packet %u\n", seqNum);        sendRR(expectedSeq, rcopy);
-        } else {
-            printf("Packet %u outside window\n", seqNum);   sendSREJ(expectedSeq, rcopy);
+            return ACK_NONE;
         }
+        return ACK_LOSS;
+    }
+    rcopy->holdDeadline = 0;   // whatever was held back is filled
+    rcopy->ackPending++;
+    return *expectedSeq - before > 1 ? ACK_NOW : ACK_DELAYED;
+}
+
+// Keeps a parity packet and rebuilds what it can. Returns ACK_LOSS if the
+// hole at expectedSeq is in its group and stays open, since the group's
+// data has all been sent by now.
+int placeParity(RcopyContext *rcopy, WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq, uint64_t group,
+                uint8_t *payload, int len) {
+    if(rcopy->fecGroup == 0 || fecStoreParity(&rcopy->fec, group, payload, len) != 0) {
+        printf("Unexpected parity packet for seq %llu\n", (unsigned long long)group);
+        return ACK_NONE;
+    }
+    if(group + rcopy->fecGroup <= *expectedSeq) {
+        return ACK_NONE;   // nothing left to rebuild
+    }
+
+    uint64_t before = *expectedSeq;
+    if(fecRecover(&rcopy->fec, wb, group, before) > 0) {
+        writeInOrder(wb, outputFile, expectedSeq);
+    }
+    if(*expectedSeq != before) {
+        rcopy->holdDeadline = 0;
+        rcopy->ackPending++;
+        return *expectedSeq - before > 1 ? ACK_NOW : ACK_DELAYED;
+    }
+    return before >= group ? ACK_LOSS : ACK_NONE;
+}
+
+// Writes out the packet at expectedSeq and every consecutive one buffered after it.
+void writeInOrder(WindowBuffer *wb, FILE *outputFile, uint64_t *expectedSeq) {
+    while(wb->panes[*expectedSeq % wb->window_size].seq_num == *expectedSeq) {
+        printf("Writing packet %llu to file\n", (unsigned long long)*expectedSeq);
+        fwrite(wb->panes[*expectedSeq % wb->window_size].data, 1, wb->buffer_size, outputFile);
+        (*expectedSeq)++;
     }
-    fclose(outputFile);     free_window(&wb);       return STATE_DONE;
 }
 
-void sendRR(int RR, RcopyContext *rcopy) {
+// Sends the ack the packets received so far call for, which also answers
+// any that were waiting on the ack delay.
+void acknowledge(RcopyContext *rcopy, WindowBuffer *wb, uint64_t expectedSeq, bool loss) {
+    if(rcopy->sack)  sendSack(expectedSeq, wb, rcopy);
+    else if(loss)    sendSREJ(expectedSeq, rcopy);
+    else             sendRR(expectedSeq, rcopy);
+    rcopy->ackPending = 0;
+    rcopy->ackDeadline = 0;
+    rcopy->holdDeadline = 0;
+}
+
+void sendRR(uint64_t RR, RcopyContext *rcopy) {
     pdu_header rr; 
-    rr.seq = htonl(RR); 
     rr.flag = 5; 
     rr.checksum = 0; 
-    sendPdu(rcopy->socketNum, &rcopy->server, rr, "RR", strlen("RR"));
+    rr.session = htonl(rcopy->sessionId); 
+    char payload[2 + FEC_REPORT_SIZE] = "RR";
+    sendSeqPdu(rcopy->socketNum, &rcopy->server, rr, RR, rcopy->wideSeq, payload, appendRepaired(rcopy, payload, 2));
+}
+
+// With FEC every RR ends with the number of packets rebuilt from parity so
+// far, which the server adapts its parity count to. Returns the new length.
+int appendRepaired(RcopyContext *rcopy, char *payload, int len) {
+    if(rcopy->fecGroup == 0) {
+        return len;
+    }
+    uint32_t repaired = htonl((uint32_t)rcopy->fec.rebuilt);
+    memcpy(payload + len, &repaired, FEC_REPORT_SIZE);
+    return len + FEC_REPORT_SIZE;
 }
 
-void sendSREJ(int SREJ, RcopyContext *rcopy) {
+void sendSREJ(uint64_t SREJ, RcopyContext *rcopy) {
     pdu_header srej; 
-    srej.seq = htonl(SREJ); 
     srej.flag = 6; 
     srej.checksum = 0; 
-    sendPdu(rcopy->socketNum, &rcopy->server, srej, "SREJ", strlen("SREJ"));
+    srej.session = htonl(rcopy->sessionId); 
+    sendSeqPdu(rcopy->socketNum, &rcopy->server, srej, SREJ, rcopy->wideSeq, "SREJ", strlen("SREJ"));
+}
+
+// RR for everything below RR, with a bitmap of the packets already
+// buffered above it so the server resends only the holes.
+void sendSack(uint64_t RR, WindowBuffer *wb, RcopyContext *rcopy) {
+    uint8_t bitmap[SACK_MAX_BYTES + FEC_REPORT_SIZE] = {0};
+    int len = 0;
+    for(uint32_t i = 0; i + 1 < (uint32_t)rcopy->windowsize && i < SACK_MAX_BYTES * 8; i++) {
+        uint64_t seq = RR + 1 + i;
+        if(wb->panes[seq % wb->window_size].seq_num == seq) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            len = i / 8 + 1;
+        }
+    }
+
+    pdu_header rr; 
+    rr.flag = 5; 
+    rr.checksum = 0; 
+    rr.session = htonl(rcopy->sessionId); 
+    len = appendRepaired(rcopy, (char *)bitmap, len);
+    sendSeqPdu(rcopy->socketNum, &rcopy->server, rr, RR, rcopy->wideSeq, (char *)bitmap, len);
 }
 
-void sendEOF(uint32_t seqNum, RcopyContext *rcopy) {
+void sendEOF(uint64_t seqNum, RcopyContext *rcopy) {
     pdu_header eof; 
-    eof.seq = htonl(0); 
     eof.flag = 10; 
     eof.checksum = 0; 
-    sendPdu(rcopy->socketNum, &rcopy->server, eof, "EOF_ACK", strlen("EOF_ACK"));
-    printf("Sent EOF ACK with seq=%u\n", seqNum);
+    eof.session = htonl(rcopy->sessionId); 
+    sendSeqPdu(rcopy->socketNum, &rcopy->server, eof, 0, rcopy->wideSeq, "EOF_ACK", strlen("EOF_ACK"));
+    printf("Sent EOF ACK with seq=%llu\n", (unsigned long long)seqNum);
 
 }
 
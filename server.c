@@ -9,6 +9,9 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #include "gethostbyname.h"
 #include "networks.h"
@@ -17,17 +20,48 @@
 #include "pollLib.h"
 #include "windowBuffer.h"
 #include "helperFunctions.h"
+#include "session.h"
+#include "eventLoop.h"
+#include "udpIo.h"
+#include "workerPool.h"
+#include "handshakeCache.h"
+#include "admission.h"
+#include "uringIo.h"
 
 // ----- Server FSM States ----- 
 typedef enum {
     STATE_WAIT_PACKET,
+    STATE_CHECK_DUPLICATE,
     STATE_TRANSFER_TO_CHILD,
 } server_state_t;
 
+// ----- Server Modes -----
+typedef enum {
+    MODE_FORK,      // one forked child per filename packet
+    MODE_EPOLL,     // all sessions in this process on one epoll loop
+    MODE_THREADS,   // one epoll loop per thread, sharded with SO_REUSEPORT
+    MODE_PREFORK,   // handshake in the parent, transfers in a pre-forked pool
+} server_mode_t;
+
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 64
+#define CHILD_TABLE_SIZE 16
+
+// A fork-mode child and the admission reservation it holds until reaped.
+typedef struct {
+    pid_t pid;
+    uint64_t admittedBytes;
+    uint64_t admittedMem;
+} ForkedChild;
+
 // ----- Server Context Structure ----- 
 typedef struct {
     int portNum; 
     int socketNum; 
+    server_mode_t mode; 
+    int numThreads; 
+    int poolMin; 
+    int poolMax; 
     double error_rate; 
     struct sockaddr_in6 client; 
     socklen_t clientAddrLen; 
@@ -36,82 +70,277 @@ typedef struct {
     uint32_t bufSize;
     char pduBuffer[MAX_PDU_SIZE + 1];  // Buffer to hold received PDU
     int pduLen;                        // Length of the received PDU
+    HandshakeCache handshakes;         // answered handshakes, for duplicate filename packets
+    uint32_t lastSessionId;            // session IDs handed out by the parent
+    bool multiplex;                    // event-loop sessions share the listen socket
+    bool gso;                          // send data bursts with UDP_SEGMENT
+    bool zeroCopy;                     // send window panes with MSG_ZEROCOPY
+    int maxSessions;                   // admission limits, 0 = unlimited
+    uint64_t maxBytes;
+    uint64_t memBudget;                // window buffer memory across all sessions
+    sender_mode_t sender;              // how sessions read the file
+    uint64_t cacheBytes;               // block cache capacity for SENDER_CACHE
+    BlockCache cache;
+    int readAhead;                     // windows prefetched past each session's nextSeq
+    const CongestionOps *congestion;   // NULL for the default (fixed window)
+    bool sessionStats;                 // -v: print statistics as each session ends
+    int fecGroup;                      // -f: data packets per parity group, 0 for no parity
+    int fecParity;                     // -f: most parity packets per group
+    int admitQueue;
+    Admission admission;
+    ForkedChild *children;             // fork mode: live children and their reservations
+    int childCount;
+    int childCap;
 } ServerContext;
 
-// ----- Child Context Structure ----- 
-typedef struct{
-    int socketNum; 
-    double error_rate; 
-    struct sockaddr_in6 client; 
-    socklen_t clientAddrLen; 
-    char filename[MAX_FILENAME + 1];
-    uint32_t winSize; 
-    uint32_t bufSize; 
-    bool eof; 
-    bool srej;    
-    int attempts;
-    char pduBuffer[MAX_PDU_SIZE + 1];  // Buffer to hold received PDU
-    int pduLen;                        // Length of the received PDU
-} ChildContext; 
-
+// ----- Worker Thread Structure -----
+// Everything a worker touches lives here, so workers share no state: each
+// has its own SO_REUSEPORT socket, session table, epoll set and ErrorSim.
+typedef struct {
+    pthread_t tid;
+    int index;
+    int socketNum;
+    double error_rate;
+    bool multiplex;
+    Admission *admission;   // the one shared structure, behind its own lock
+    ErrorSim sim;
+    EventLoop loop;
+} ServerWorker;
 
 // ----- Sever Functions -----
 void runServerFSM(ServerContext *server);
 void processFilenamePacket(int socketNum, int payload_len, uint8_t *p, struct sockaddr_in6 *client);
-int  checkArgs(int argc, char *argv[]);
+int  checkArgs(int argc, char *argv[], ServerContext *server);
 void childInfo(ChildContext *child, ServerContext *server); 
+void runEpollServer(ServerContext *server);
+void runThreadedServer(ServerContext *server);
+void runPreforkServer(ServerContext *server);
+void *workerMain(void *arg);
+void trackChild(ServerContext *server, pid_t pid, ChildContext *child);
+void reapChildren(ServerContext *server);
 
 // ----- Child Functions ----- 
 void runChild(ChildContext *child); 
 void transferData(ChildContext *child); 
-void send_data_packet(ChildContext *child, WindowBuffer *wb, uint32_t seq, 
-                        bool isEOF, size_t bytesRead); 
-
-void send_next_data(ChildContext *child, WindowBuffer *wb, uint32_t *nextSeq, 
-                    bool *eofSent, uint32_t *eofSeq, FILE *file);
-
-void retransmit_packets(ChildContext *child, WindowBuffer *wb, uint32_t base, 
-                        uint32_t nextSeq, bool eofSent, uint32_t eofSeq); 
-
-void send_eof_packet(ChildContext *child, uint32_t seq); 
-int processClient(ChildContext *child, int dataLen, char *buffer);  
-bool lookupFilename(const char *filename); 
 
 int main ( int argc, char *argv[]  ){ 
     ServerContext server; 
     memset(&server, 0, sizeof(ServerContext)); // Fixed sizeof issue
-    server.portNum = checkArgs(argc, argv);
+    server.portNum = checkArgs(argc, argv, &server);
+    server.error_rate = atof(argv[optind]); 
+    if (server.sender == SENDER_URING && !probeUring()) {
+        fprintf(stderr, "io_uring not available, -r uring falls back to -r read\n");
+        server.sender = SENDER_READ;
+    }
+    setSenderMode(server.sender);
+    setReadAhead(server.readAhead);
+    setSessionStats(server.sessionStats);
+    if (server.congestion) {
+        setCongestionControl(server.congestion);
+        printf("Congestion control: %s\n", server.congestion->name);
+    }
+    if (server.fecGroup > 0) {
+        setFecGroups(server.fecGroup, server.fecParity);
+        printf("FEC: up to %d parity packets per %d data packets\n", server.fecParity, server.fecGroup);
+    }
+    setPduBatching(server.error_rate == 0);   // with errors on, sends must go through sendtoErr()
+    if (server.gso) {
+        if (!probeUdpGso()) {
+            fprintf(stderr, "UDP GSO not supported by this kernel, -g ignored\n");
+        } else if (server.error_rate > 0 && server.mode != MODE_THREADS) {
+            fprintf(stderr, "UDP GSO needs batched sends (error rate 0 or -m threads), -g ignored\n");
+        } else {
+            setUdpGso(true);
+            printf("UDP GSO enabled\n");
+        }
+    }
+    if (server.zeroCopy) {
+        if (server.sender != SENDER_READ) {
+            fprintf(stderr, "MSG_ZEROCOPY only applies to -r read, -z ignored\n");
+        } else if (server.error_rate > 0) {
+            fprintf(stderr, "MSG_ZEROCOPY needs an error rate of 0, -z ignored\n");
+        } else {
+            setZeroCopy(true);
+            printf("MSG_ZEROCOPY enabled (experimental)\n");
+        }
+    }
+    if (server.sender == SENDER_CACHE) {
+        initBlockCache(&server.cache, server.cacheBytes);
+        setBlockCache(&server.cache);
+    }
+    initAdmission(&server.admission, server.maxSessions, server.maxBytes, server.memBudget, server.admitQueue);
+
+    if (server.mode == MODE_THREADS) {
+        // Workers open their own sockets and never touch libcpe464 or pollLib
+        runThreadedServer(&server);
+        return 0;
+    }
+
     server.socketNum = udpServerSetup(server.portNum);  
-    server.error_rate = atof(argv[1]); 
+    setDontFragment(server.socketNum);   // multiplexed sessions send from it
     setupPollSet(); 
     sendErr_init(server.error_rate, DROP_ON, FLIP_OFF, DEBUG_ON, RSEED_ON);
 
-    runServerFSM(&server); 
+    if (server.mode == MODE_EPOLL) {
+        runEpollServer(&server);
+    } else if (server.mode == MODE_PREFORK) {
+        runPreforkServer(&server);
+    } else {
+        runServerFSM(&server); 
+    }
     close(server.socketNum); 
 
     return 0;
 }
 
-int checkArgs(int argc, char *argv[]){
+int checkArgs(int argc, char *argv[], ServerContext *server){
     // Checks args and returns port number
     int portNumber = 0;
+    int opt;
+
+    server->mode = MODE_FORK;
+    server->numThreads = DEFAULT_THREADS;
+    server->poolMin = POOL_DEFAULT_MIN;
+    server->poolMax = POOL_DEFAULT_MAX;
+    server->admitQueue = ADMIT_DEFAULT_QUEUE;
+    server->memBudget = WINDOW_DEFAULT_BUDGET;
+    server->cacheBytes = CACHE_DEFAULT_BYTES;
+    server->readAhead = READ_AHEAD_DEFAULT;
+    server->lastSessionId = (uint32_t)(getTimeMs() << 8);   // so IDs from a previous run rarely match
+    while ((opt = getopt(argc, argv, "m:t:p:xgzs:b:q:M:r:C:a:c:f:v")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "fork") == 0) {
+                    server->mode = MODE_FORK;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    server->mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    server->mode = MODE_THREADS;
+                } else if (strcmp(optarg, "prefork") == 0) {
+                    server->mode = MODE_PREFORK;
+                } else {
+                    fprintf(stderr, "Error: unknown server mode '%s' (fork, epoll, threads or prefork)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                server->numThreads = atoi(optarg);
+                if (server->numThreads < 1 || server->numThreads > MAX_THREADS) {
+                    fprintf(stderr, "Error: thread count must be between 1 and %d\n", MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'x':
+                server->multiplex = true;
+                break;
+            case 'g':
+                server->gso = true;
+                break;
+            case 'z':
+                server->zeroCopy = true;
+                break;
+            case 'v':
+                server->sessionStats = true;
+                break;
+            case 's':
+                server->maxSessions = atoi(optarg);
+                if (server->maxSessions < 0) {
+                    fprintf(stderr, "Error: session limit must be 0 (unlimited) or more\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                server->maxBytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                if (strcmp(optarg, "read") == 0) {
+                    server->sender = SENDER_READ;
+                } else if (strcmp(optarg, "mmap") == 0) {
+                    server->sender = SENDER_MMAP;
+                } else if (strcmp(optarg, "cache") == 0) {
+                    server->sender = SENDER_CACHE;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    server->sender = SENDER_URING;
+                } else {
+                    fprintf(stderr, "Error: unknown sender '%s' (read, mmap, cache or uring)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                server->congestion = findCongestionOps(optarg);
+                if (server->congestion == NULL) {
+                    fprintf(stderr, "Error: unknown congestion control '%s' (fixed, reno, cubic or bbr)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                if (sscanf(optarg, "%d:%d", &server->fecGroup, &server->fecParity) != 2 ||
+                    server->fecGroup < 2 || server->fecGroup > FEC_MAX_GROUP ||
+                    server->fecParity < 1 || server->fecParity > FEC_MAX_PARITY ||
+                    server->fecParity >= server->fecGroup) {
+                    fprintf(stderr, "Error: FEC must be <group>:<parity> with 2 <= group <= %d and 1 <= parity <= %d, below group\n",
+                            FEC_MAX_GROUP, FEC_MAX_PARITY);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                server->cacheBytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'a':
+                server->readAhead = atoi(optarg);
+                if (server->readAhead < 0) {
+                    fprintf(stderr, "Error: read-ahead must be 0 (off) or more windows\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                server->memBudget = strtoull(optarg, NULL, 10);
+                break;
+            case 'q':
+                server->admitQueue = atoi(optarg);
+                if (server->admitQueue < 0) {
+                    fprintf(stderr, "Error: wait queue length must be 0 or more\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                if (sscanf(optarg, "%d:%d", &server->poolMin, &server->poolMax) != 2 ||
+                    server->poolMin < 1 || server->poolMax < server->poolMin) {
+                    fprintf(stderr, "Error: pool size must be <min>:<max> with 1 <= min <= max\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s <error-rate> <optional port number> [-m fork|epoll|threads|prefork] [-t threads] [-p min:max] [-x] [-g] [-z] [-s sessions] [-b bytes] [-q waiters] [-M budget] [-r read|mmap|cache|uring] [-C bytes] [-a windows] [-c fixed|reno|cubic|bbr] [-f group:parity] [-v]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (server->multiplex && server->mode != MODE_EPOLL && server->mode != MODE_THREADS) {
+        fprintf(stderr, "Error: -x (multiplexed sessions) needs -m epoll or -m threads\n");
+        exit(EXIT_FAILURE);
+    }
+    if (server->sender == SENDER_CACHE && server->mode != MODE_EPOLL && server->mode != MODE_THREADS) {
+        fprintf(stderr, "Error: -r cache needs -m epoll or -m threads, where sessions share one process\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (argc < 2)
+    if (argc - optind < 1)
     {
-        fprintf(stderr, "Usage: %s <error-rate> <optional port number>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <error-rate> <optional port number> [-m fork|epoll|threads|prefork] [-t threads] [-p min:max] [-x] [-g] [-z] [-s sessions] [-b bytes] [-q waiters] [-M budget] [-r read|mmap|cache|uring] [-C bytes] [-a windows] [-c fixed|reno|cubic|bbr] [-f group:parity] [-v]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     double errorRate = 0.0; 
-    errorRate = atof(argv[1]); 
+    errorRate = atof(argv[optind]); 
     if(errorRate < 0 || errorRate > 1)
     {
-        fprintf(stderr, "Error: %s <error-rate> must be between 0.0 and 1.0\n", argv[1]); 
+        fprintf(stderr, "Error: %s <error-rate> must be between 0.0 and 1.0\n", argv[optind]); 
         exit(EXIT_FAILURE); 
     }
     
-    if (argc > 2) {
-        portNumber = atoi(argv[2]);
+    if (argc - optind > 1) {
+        portNumber = atoi(argv[optind + 1]);
     } else {
         portNumber = 0;  // Let the OS choose a port
     }
@@ -122,11 +351,18 @@ int checkArgs(int argc, char *argv[]){
 void runServerFSM(ServerContext *server){
     server_state_t state = STATE_WAIT_PACKET; 
     int pduLen; char pdu[MAX_PDU_SIZE + 1]; 
+    ChildContext childCtx;
+    PendingHandshake *pending;
+
+    initHandshakeCache(&server->handshakes);
 
     while(1){
         switch(state){
             case STATE_WAIT_PACKET:
                 printf("----- FSM: STATE_WAIT_PACKET -----\n");
+                reapChildren(server);
+                expireHandshakes(&server->handshakes);
+
                 server->clientAddrLen = sizeof(server->client); 
                 pduLen = safeRecvfrom(server->socketNum, pdu, MAX_PDU_SIZE, 0, (struct sockaddr *)&server->client, (int *)(&server->clientAddrLen));
 
@@ -136,29 +372,57 @@ void runServerFSM(ServerContext *server){
                 pdu_header header;
                 memcpy(&header, pdu, sizeof(pdu_header));
                 
-                state = STATE_TRANSFER_TO_CHILD;
+                state = STATE_CHECK_DUPLICATE;
                 memcpy(server->pduBuffer, pdu, pduLen);
                 server->pduLen = pduLen;
                 break;
+
+            case STATE_CHECK_DUPLICATE:
+                printf("----- FSM: STATE_CHECK_DUPLICATE -----\n");
+                state = STATE_WAIT_PACKET;
+                memset(&childCtx, 0, sizeof(childCtx));
+                childInfo(&childCtx, server);
+                if (parseFilenamePdu(&childCtx, childCtx.pduLen, childCtx.pduBuffer) != 0) { break; }
+
+                // A retransmitted filename packet gets the original answer, not a new child
+                pending = findHandshake(&server->handshakes, &childCtx.client, childCtx.nonce);
+                if (pending) {
+                    printf("Duplicate filename packet (nonce %u), resending ACK\n", childCtx.nonce);
+                    resendHandshakeAck(pending->socketNum, &childCtx.client, pending->sessionId, pending->ackPayload, pending->ackLen);
+                    break;
+                }
+                state = STATE_TRANSFER_TO_CHILD;
+                break;
                 
             case STATE_TRANSFER_TO_CHILD:
                 printf("----- FSM: STATE_TRANSFER_TO_CHILD -----\n");
-                pid_t childPid = fork(); 
-                if(childPid < 0){
-                    perror("fork");
-                    state = STATE_WAIT_PACKET;
-                } else if (childPid == 0){
-                    close(server->socketNum);     
-                    ChildContext childCtx;
-                    childInfo(&childCtx, server); 
-
-                    memcpy(childCtx.pduBuffer, server->pduBuffer, server->pduLen);
-                    childCtx.pduLen = server->pduLen;
-                    
-                    runChild(&childCtx);
-                    exit(0); 
-                }
                 state = STATE_WAIT_PACKET;  // Keep listening for new clients
+                reapChildren(server);       // free slots before deciding on admission
+                if (admitClient(&server->admission, &childCtx, server->socketNum) != 0) { break; }
+                if (openSessionSocket(&childCtx) < 0) { releaseClient(&server->admission, &childCtx); break; }
+                childCtx.sessionId = allocSessionId(&server->lastSessionId);
+
+                // Answer here so the parent can repeat the answer to duplicates
+                int answered = answerHandshake(&childCtx);
+                rememberHandshake(&server->handshakes, &childCtx);
+
+                if (answered == 0) {
+                    fflush(stdout);
+                    pid_t childPid = fork(); 
+                    if(childPid < 0){
+                        perror("fork");
+                    } else if (childPid == 0){
+                        close(server->socketNum);     
+                        closeHandshakeFds(&server->handshakes);
+                        runChild(&childCtx);
+                        exit(0); 
+                    } else {
+                        trackChild(server, childPid, &childCtx);
+                        childCtx.admitted = false;
+                    }
+                }
+                releaseClient(&server->admission, &childCtx);
+                close(childCtx.socketNum);
                 break; 
 
             default:
@@ -170,33 +434,145 @@ void runServerFSM(ServerContext *server){
     }
 }
 
-void childInfo(ChildContext *child, ServerContext *server){
-    // Initialize the child context with server data
-    child->socketNum = socket(AF_INET6, SOCK_DGRAM, 0);
-
-    // ------ Delete later, only to debug port ----
-    // Bind socket to get a port
-    struct sockaddr_in6 childAddr;
-    memset(&childAddr, 0, sizeof(childAddr));
-    childAddr.sin6_family = AF_INET6;
-    childAddr.sin6_addr = in6addr_any;
-    childAddr.sin6_port = 0; // Let the OS choose a port
-    
-    if (bind(child->socketNum, (struct sockaddr *)&childAddr, sizeof(childAddr)) < 0) {
-        perror("Child socket bind failed");
-        return;
+void runEpollServer(ServerContext *server){
+    printf("----- SERVER: EPOLL MODE -----\n");
+    EventLoop loop;
+    initEventLoop(&loop, server->socketNum, server->error_rate, server->multiplex, &server->admission);
+    runEventLoop(&loop);
+    freeEventLoop(&loop);
+}
+
+void runThreadedServer(ServerContext *server){
+    printf("----- SERVER: THREADED MODE (%d workers) -----\n", server->numThreads);
+    ServerWorker *workers = sCalloc(server->numThreads, sizeof(ServerWorker));
+    int port = server->portNum;
+    long seed = time(NULL);
+
+    for (int i = 0; i < server->numThreads; i++) {
+        ServerWorker *w = &workers[i];
+        w->index = i;
+        w->error_rate = server->error_rate;
+        w->multiplex = server->multiplex;
+        w->admission = &server->admission;
+        w->socketNum = udpServerSetupReusePort(port);
+        setDontFragment(w->socketNum);
+
+        // With port 0 the first worker picks the port, the rest join it
+        if (port == 0) {
+            struct sockaddr_in6 addr;
+            socklen_t addrLen = sizeof(addr);
+            getsockname(w->socketNum, (struct sockaddr *)&addr, &addrLen);
+            port = ntohs(addr.sin6_port);
+        }
+        initErrorSim(&w->sim, w->error_rate, DROP_ON, FLIP_ON, seed + i);
     }
-    
-    // Get the assigned port number
-    socklen_t addrLen = sizeof(childAddr);
-    if (getsockname(child->socketNum, (struct sockaddr *)&childAddr, &addrLen) < 0) {
-        perror("getsockname failed");
-    } else {
-        printf("Child process (PID: %d) bound to port: %d\n", 
-                getpid(), ntohs(childAddr.sin6_port));
+
+    for (int i = 0; i < server->numThreads; i++) {
+        if (pthread_create(&workers[i].tid, NULL, workerMain, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
     }
-    // -------------------------------------------
-    
+    for (int i = 0; i < server->numThreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+    free(workers);
+}
+
+void *workerMain(void *arg){
+    ServerWorker *w = arg;
+    printf("Worker %d running on socket %d\n", w->index, w->socketNum);
+
+    bindErrorSim(&w->sim);
+    initEventLoop(&w->loop, w->socketNum, w->error_rate, w->multiplex, w->admission);
+    runEventLoop(&w->loop);
+    freeEventLoop(&w->loop);
+    close(w->socketNum);
+    return NULL;
+}
+
+void runPreforkServer(ServerContext *server){
+    printf("----- SERVER: PREFORK MODE -----\n");
+    WorkerPool pool;
+    initHandshakeCache(&server->handshakes);
+    initWorkerPool(&pool, server->poolMin, server->poolMax, server->error_rate,
+                   server->socketNum, &server->handshakes, &server->admission, transferData);
+    addToPollSet(server->socketNum);
+
+    while (1) {
+        int fd = pollCall(POOL_IDLE_MS);
+        if (fd == server->socketNum) {
+            ChildContext child;
+            memset(&child, 0, sizeof(child));
+            child.error_rate = server->error_rate;
+            child.clientAddrLen = sizeof(child.client);
+            child.pduLen = safeRecvfrom(server->socketNum, child.pduBuffer, MAX_PDU_SIZE, 0,
+                                        (struct sockaddr *)&child.client, (int *)&child.clientAddrLen);
+
+            if (child.pduLen < (int)sizeof(pdu_header) || in_cksum((unsigned short *)child.pduBuffer, child.pduLen)) {
+                printf("Corrupt or short packet on listen socket, ignoring\n");
+            } else if (parseFilenamePdu(&child, child.pduLen, child.pduBuffer) == 0) {
+                PendingHandshake *pending = findHandshake(&server->handshakes, &child.client, child.nonce);
+                if (pending) {
+                    printf("Duplicate filename packet (nonce %u), resending ACK\n", child.nonce);
+                    resendHandshakeAck(pending->socketNum, &child.client, pending->sessionId, pending->ackPayload, pending->ackLen);
+                } else if (admitClient(&server->admission, &child, server->socketNum) != 0) {
+                    // told to come back later
+                } else if (openSessionSocket(&child) == 0) {
+                    child.sessionId = allocSessionId(&server->lastSessionId);
+                    // The worker sends the "Ok", so only a session one takes is acknowledged
+                    if (buildHandshakeAck(&child) != 0) {
+                        resendHandshakeAck(child.socketNum, &child.client, child.sessionId, child.ackPayload, child.ackLen);
+                        rememberHandshake(&server->handshakes, &child);
+                    } else if (dispatchSession(&pool, &child) == 0) {
+                        rememberHandshake(&server->handshakes, &child);
+                    } else {
+                        printf("No worker took the session for %s, told to retry in %u ms\n", child.filename, ADMIT_RETRY_MS);
+                        sendBusyAck(server->socketNum, &child.client, ADMIT_RETRY_MS);
+                    }
+                    releaseClient(&server->admission, &child);   // unless the pool took it over
+                    close(child.socketNum);
+                } else {
+                    releaseClient(&server->admission, &child);
+                }
+            }
+        } else if (fd > 0 && isPoolChannel(&pool, fd)) {
+            poolChannelReadable(&pool, fd);
+        }
+        trimWorkerPool(&pool);
+        expireHandshakes(&server->handshakes);
+    }
+}
+
+void trackChild(ServerContext *server, pid_t pid, ChildContext *child){
+    if (server->childCount == server->childCap) {
+        server->childCap = server->childCap ? server->childCap * 2 : CHILD_TABLE_SIZE;
+        server->children = srealloc(server->children, server->childCap * sizeof(ForkedChild));
+    }
+    server->children[server->childCount].pid = pid;
+    server->children[server->childCount].admittedBytes = child->admittedBytes;
+    server->children[server->childCount].admittedMem = child->admittedMem;
+    server->childCount++;
+}
+
+// Reaps finished children and hands their admission reservations back.
+void reapChildren(ServerContext *server){
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < server->childCount; i++) {
+            if (server->children[i].pid == pid) {
+                releaseReservation(&server->admission, server->children[i].admittedBytes,
+                                   server->children[i].admittedMem);
+                server->children[i] = server->children[--server->childCount];
+                break;
+            }
+        }
+    }
+}
+
+void childInfo(ChildContext *child, ServerContext *server){
+    // Initialize the child context with server data
+    child->socketNum = -1;
     child->error_rate = server->error_rate;
     child->client = server->client;
     child->clientAddrLen = server->clientAddrLen;
@@ -207,197 +583,68 @@ void childInfo(ChildContext *child, ServerContext *server){
     // Copy the PDU buffer and length
     memcpy(child->pduBuffer, server->pduBuffer, server->pduLen);
     child->pduLen = server->pduLen;
-    
-    // Initialize sendtoErr and polling
-    sendErr_init(child->error_rate, DROP_ON, FLIP_ON, DEBUG_ON, RSEED_ON);
-    setupPollSet();
-    addToPollSet(child->socketNum);
 }
 
 
 void runChild(ChildContext *child) {
     printf("----- CHILD: START -----\n");
+
+    // Initialize sendtoErr and polling
+    sendErr_init(child->error_rate, DROP_ON, FLIP_ON, DEBUG_ON, RSEED_ON);
+    setupPollSet();
+    addToPollSet(child->socketNum);
     
-    // Process the initial packet (should be a filename packet)
-    if (processClient(child, child->pduLen, child->pduBuffer) == 0) {
-        // Valid filename packet, start data transfer
+    // The parent already answered the filename packet, start data transfer
+    if (beginTransfer(child) == 0) {
         transferData(child);
-
     }
 
-    close(child->socketNum);
+    finishTransfer(child);
     printf("----- CHILD: DONE -----\n");
 }
 
 
 
 void transferData(ChildContext *child){
-    printf("----- CHILD: TRANSFER DATA -----\n");
-    // char filePath[256]; 
-    // snprintf(filePath, sizeof(filePath), "test_files/%s.txt", child->filename); 
-
-    FILE *file = fopen(child->filename, "rb"); 
-    if(!file){ perror("Error opening file"); return; }
-
-    WindowBuffer wb;        init_window(&wb, child->winSize, child->bufSize, file);
-    uint32_t nextSeq = 0,   base = 0,   eofSeq = 0;
-    bool eofSent = false,   eofAcked = false; 
-
-    // ----- Initial Window of Packets -----
-    printf("----- CHILD: SENDING DATA (INITIAL)-----\n");
-    while (nextSeq < wb.window_size && !feof(file)) {
-        printf("----- CHILD: PACKET - SEQ: %u-----\n", nextSeq);
-        size_t bytesRead = fread(wb.panes[nextSeq].data, 1, wb.buffer_size, file);
-        wb.panes[nextSeq].seq_num = nextSeq;
-                
-        if(bytesRead > 0){ send_data_packet(child, &wb, nextSeq, eofSent, bytesRead);     nextSeq++;}
-        if (bytesRead == 0 || feof(file)) {
-            printf("EO DETECTED at seq=%u\n", nextSeq);
-            send_eof_packet(child, nextSeq); 
-            eofSent = true;     eofSeq = nextSeq; nextSeq++;  
-            break;
-        }
-
-
-    }
-
     printf("----- CHILD: SENDING DATA (MAIN)-----\n");
-    while (!eofAcked && child->attempts < MAX_ATTEMPTS) {
-        int pollResult = pollCall(POLL_ONE_SEC);
-        
-        if (pollResult > 0) {
-            child->attempts = 0; uint8_t buffer[MAX_PDU_SIZE];
-            int recvLen = safeRecvfrom(child->socketNum, buffer, MAX_PDU_SIZE, 0, (struct sockaddr *)&child->client, (int *)&child->clientAddrLen);
-            
-            if (recvLen > 0 && !in_cksum((unsigned short *)buffer, recvLen)) {
-                pdu_header header;
-                memcpy(&header, buffer, sizeof(pdu_header));
-                uint32_t ackSeq = ntohl(header.seq);
-                
-                if (header.flag == 5) {  // RR
-                    if (ackSeq > base) {
-                        printf("RR: ack=%u (moving window: %u → %u)\n", ackSeq, base, ackSeq);
-                        slide_window(&wb, ackSeq - base); base = ackSeq;
-                        
-                        // Send more packets if window opened
-                        while (nextSeq < base + wb.window_size && !eofSent) {
-                            send_next_data(child, &wb, &nextSeq, &eofSent, &eofSeq, file);
-                        }
-                    } else {
-                        printf("RR: Duplicate/Old ack=%u (current base=%u)\n", ackSeq, base);
-                    }
-                } else if (header.flag == 6) {  // SREJ
-                    printf("SREJ: Resending packet seq=%u\n", ackSeq);
-                    size_t bytesRead = (eofSent && ackSeq == eofSeq) ? 0 : wb.buffer_size;
-                    send_data_packet(child, &wb, ackSeq, (eofSent && ackSeq == eofSeq), bytesRead);
-                } else if (header.flag == 10) {  // EOF ACK
-                    printf("EOF_ACK: Received for seq=%u\n", ackSeq); eofAcked = true;
-                }
-            }
-        } else { child->attempts++; retransmit_packets(child, &wb, base, nextSeq, eofSent, eofSeq);}
-        
-    }
-    fclose(file); free_window(&wb);
-}
-
-void send_eof_packet(ChildContext *child, uint32_t seq) {
-    pdu_header header = {
-        .seq = htonl(seq),
-        .flag = 10,  // EOF flag
-        .checksum = 0
-    };
-    
-    printf("SEND: seq=%u, flag=10, EOF (no data)\n", seq);
-    
-    // Send EOF with no data payload
-    sendPdu(child->socketNum, &child->client, header, "", 0);
-}
-
-void send_data_packet(ChildContext *child, WindowBuffer *wb, uint32_t seq, bool isEOF, size_t bytesRead) {
-    pdu_header header = {
-        .seq = htonl(seq),
-        .flag = isEOF ? 10 : 16,  // 10=EOF, 16=data
-        .checksum = 0
-    };
-    
-    printf("SEND: seq=%u, flag=%d, %s\n", seq, header.flag, isEOF ? "EOF" : "DATA");
-    
-    // Use actual bytesRead instead of wb->buffer_size
-    sendPdu(child->socketNum, &child->client, header, 
-           (const char*)wb->panes[seq % wb->window_size].data, bytesRead);
-}
-
-void send_next_data(ChildContext *child, WindowBuffer *wb, uint32_t *nextSeq, 
-                   bool *eofSent, uint32_t *eofSeq, FILE *file) {
-    size_t bytesRead = fread(wb->panes[*nextSeq % wb->window_size].data, 
-                            1, wb->buffer_size, file);
-    wb->panes[*nextSeq % wb->window_size].seq_num = *nextSeq;
-    
-    if (bytesRead < wb->buffer_size || feof(file)) {
-        *eofSent = true;
-        *eofSeq = *nextSeq;
-        printf("EOF DETECTED at seq=%u (read %zu bytes)\n", *nextSeq, bytesRead);
+    int ringFd = sessionUringFd();
+    if (ringFd >= 0) {
+        addToPollSet(ringFd);
     }
-    
-    send_data_packet(child, wb, *nextSeq, *eofSent && (*nextSeq == *eofSeq), bytesRead);
-    (*nextSeq)++;
-}
-
-void retransmit_packets(ChildContext *child, WindowBuffer *wb, uint32_t base, 
-                       uint32_t nextSeq, bool eofSent, uint32_t eofSeq) {
-    printf("TIMEOUT: Retransmitting packets seq=%u to %u\n", base, nextSeq-1);
-    
-    for (uint32_t i = base; i < nextSeq; i++) {
-        // Special case for the EOF packet
-        if (eofSent && i == eofSeq) {
-            // For EOF packet, send 0 bytes of data
-            send_data_packet(child, wb, i, true, 0);
-        } else {
-            // For data packets, use buffer_size (may be inefficient for the last packet)
-            send_data_packet(child, wb, i, false, wb->buffer_size);
+    int paceFd = openPaceTimer();
+    uint64_t paceArmedUs = 0;
+    addToPollSet(paceFd);
+
+    while (!child->done) {
+        uint64_t now = getTimeMs();
+        int timeout = child->deadline > now ? (int)(child->deadline - now) : 0;
+        uint64_t paceAt = child->paceWaiting ? child->paceAtUs : 0;
+        if (paceAt != paceArmedUs) {
+            armPaceTimer(paceFd, paceAt);
+            paceArmedUs = paceAt;
         }
-    }
-}
-int processClient(ChildContext *child, int dataLen, char *buffer){
-    printf("----- CHILD: PRCESSING CLIENT -----\n");
-    
-    pdu_header header;
-    memcpy(&header, buffer, sizeof(pdu_header));
-    
-    if (header.flag == 8) {
-        // Minimum size check
-        if (dataLen < (int)(sizeof(pdu_header) + 9)) {
-            fprintf(stderr, "Payload too short for filename packet\n");
-            return -1;
+
+        int fd = pollCall(timeout);
+        if (fd >= 0 && fd == ringFd) {
+            reapSessionUring();
+        } else if (fd >= 0 && fd == paceFd) {
+            clearPaceTimer(paceFd);
+            paceArmedUs = 0;
+        } else if (fd > 0) {
+            sessionReadable(child);
+        } else if (getTimeMs() >= child->deadline) {
+            sessionTimeout(child);
         }
-        
-        uint32_t *sizes_ptr = (uint32_t *)(buffer + sizeof(pdu_header));
-        child->winSize = ntohl(sizes_ptr[0]);
-        child->bufSize = ntohl(sizes_ptr[1]);
-        
-        uint8_t name_len = buffer[sizeof(pdu_header) + 8];
-        memcpy(child->filename, buffer + sizeof(pdu_header) + 9, name_len);
-        child->filename[name_len] = '\0';
-        
-        pdu_header ack = {.seq = htonl(0), .flag = 9, .checksum = 0};
-        const char *msg = lookupFilename(child->filename) ? "Ok" : "Not Ok";
-        
-        if (sendPdu(child->socketNum, &child->client, ack, msg, strlen(msg)) < 0) {
-            fprintf(stderr, "ERROR: Failed to send %s\n", msg);
-            return -1;
+
+        // Checked whichever fd woke us, since pollCall() favours the lowest
+        if (!child->done && child->paceWaiting && child->paceAtUs <= getTimeUs() + PACE_SLACK_US) {
+            sessionPace(child);
         }
-        return strcmp(msg, "Ok") == 0 ? 0 : -1;
     }
-    return -1;  // Unrecognized packet type
-}
 
-bool lookupFilename(const char *filename) {
-    
-    if (access(filename, R_OK) == 0) {
-        printf("File \"%s\" found and readable.\n", filename);
-        return true;
-    } else {
-        printf("File \"%s\" not found or not readable.\n", filename);
-        return false;
+    removeFromPollSet(paceFd);
+    close(paceFd);
+    if (ringFd >= 0) {
+        removeFromPollSet(ringFd);
     }
-}
\ No newline at end of file
+}
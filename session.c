@@ -0,0 +1,1284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+
+#include "networks.h"
+#include "safeUtil.h"
+#include "cpe464.h"
+#include "session.h"
+#include "udpIo.h"
+#include "uringIo.h"
+
+_Static_assert(sizeof(pdu_wide_header) == PANE_HEADROOM, "pane headroom must fit either pdu header");
+
+// One block in flight on the ring: read from the file into packet, right
+// after the header, then sent straight from there.
+typedef struct UringRequest {
+    ChildContext *child;
+    uint64_t seq;
+    bool sending;
+    uint32_t len;        // bytes of the block to read
+    uint32_t got;        // bytes read so far
+    struct UringRequest *next;   // while waiting in the backlog
+    struct iovec iov;
+    struct msghdr msg;
+    uint8_t packet[];    // header and one block of the session's buffer size
+} UringRequest;
+
+static sender_mode_t g_senderMode = SENDER_READ;
+static BlockCache *g_blockCache = NULL;
+static uint32_t g_readAheadWindows = READ_AHEAD_DEFAULT;
+static const CongestionOps *g_congestion = &fixedCongestion;
+static uint16_t g_fecGroup = 0;
+static uint8_t g_fecParity = 0;
+static bool g_sessionStats = false;
+static _Thread_local Uring *threadRing = NULL;
+static _Thread_local bool threadRingFailed = false;
+static _Thread_local UringRequest *backlogHead = NULL;   // requests the ring had no room for
+static _Thread_local UringRequest *backlogTail = NULL;
+
+static int  mapFile(ChildContext *child);
+static int  openCachedFile(ChildContext *child);
+static void releaseCachedBlocks(ChildContext *child, uint64_t from, uint64_t to);
+static bool validControlPdu(ChildContext *child, uint8_t *buffer, int recvLen);
+static void applyRR(ChildContext *child, uint64_t ackSeq);
+static int  applySREJ(ChildContext *child, uint64_t ackSeq);
+static void applySack(ChildContext *child, uint64_t ackSeq, const uint8_t *bitmap, int len);
+static int  resendHoles(ChildContext *child);
+static void resizeSlots(ChildContext *child, uint32_t oldSize);
+static uint64_t sampleRtt(ChildContext *child, uint64_t from, uint64_t to);
+static uint32_t sendLimit(ChildContext *child);
+static void sendNewData(ChildContext *child);
+static void stampSend(ChildContext *child, uint64_t seq);
+static void restartTimer(ChildContext *child);
+static const uint8_t *blockData(ChildContext *child, uint64_t seq);
+static Uring *sessionRing(void);
+static int  openUringFile(ChildContext *child);
+static void submitBlockRead(ChildContext *child, uint64_t seq, size_t len);
+static void submitSend(UringRequest *req, int len);
+static void sendParity(ChildContext *child, uint64_t seq, const uint8_t *data);
+static void uringComplete(UringRequest *req, int res);
+static void startRequest(UringRequest *req);
+static bool prepRequest(UringRequest *req);
+static void drainBacklog(void);
+static void flushOutput(void);
+static void readAhead(ChildContext *child);
+
+void setSenderMode(sender_mode_t mode){
+    g_senderMode = mode;
+}
+
+bool sessionsUsePanes(void){
+    return g_senderMode != SENDER_MMAP && !(g_senderMode == SENDER_CACHE && g_blockCache != NULL);
+}
+
+void setCongestionControl(const CongestionOps *ops){
+    g_congestion = ops;
+}
+
+void setFecGroups(uint16_t groupSize, uint8_t maxParity){
+    g_fecGroup = groupSize;
+    g_fecParity = maxParity;
+}
+
+void setReadAhead(uint32_t windows){
+    g_readAheadWindows = windows;
+}
+
+void setBlockCache(BlockCache *cache){
+    g_blockCache = cache;
+}
+
+void setSessionStats(bool enabled){
+    g_sessionStats = enabled;
+}
+
+int openSessionSocket(ChildContext *child){
+    child->socketNum = udpSessionSetup();
+    if (child->socketNum < 0) {
+        fprintf(stderr, "Child socket setup failed\n");
+        return -1;
+    }
+    child->ownsSocket = true;
+    setDontFragment(child->socketNum);
+
+    // Get the assigned port number
+    struct sockaddr_in6 childAddr;
+    socklen_t addrLen = sizeof(childAddr);
+    if (getsockname(child->socketNum, (struct sockaddr *)&childAddr, &addrLen) < 0) {
+        perror("getsockname failed");
+    } else {
+        printf("Session (PID: %d) bound to port: %d\n",
+                getpid(), ntohs(childAddr.sin6_port));
+    }
+    return 0;
+}
+
+int beginTransfer(ChildContext *child){
+    child->file = NULL;
+    child->nextSeq = 0;     child->base = 0;
+    child->eofSeq = 0;      child->eofLen = 0;
+    child->eofSent = false; child->eofAcked = false;
+    child->attempts = 0;    child->prefetchSeq = 0;
+    child->paceAtUs = 0;    child->paceWaiting = false;
+    child->done = true;
+
+    printf("----- CHILD: TRANSFER DATA -----\n");
+    if (!sessionsUsePanes()) {
+        // Admission charged no panes for these, so they can't fall back to fread
+        int opened = g_senderMode == SENDER_MMAP ? mapFile(child) : openCachedFile(child);
+        if (opened != 0) {
+            fprintf(stderr, "Can't %s %s, ending session\n",
+                    g_senderMode == SENDER_MMAP ? "map" : "cache", child->filename);
+            return -1;
+        }
+        // No window copy: blocks come from the mapping or the shared cache
+        memset(&child->wb, 0, sizeof(child->wb));
+        child->wb.window_size = child->winSize;
+        child->wb.buffer_size = child->bufSize;
+    } else if (g_senderMode == SENDER_URING && openUringFile(child) == 0) {
+        init_window(&child->wb, child->winSize, child->bufSize, NULL);
+    } else {
+        child->file = fopen(child->filename, "rb");
+        if(!child->file){ perror("Error opening file"); return -1; }
+        init_window(&child->wb, child->winSize, child->bufSize, child->file);
+        child->zeroCopy = zeroCopyActive(child->socketNum) && !loopbackAddress(&child->client);
+    }
+    child->sendWindow = child->winSize;
+    child->slots = sCalloc(child->wb.window_size, sizeof(SendSlot));
+    initRttEstimator(&child->rtt);
+    initCongestion(&child->cc, g_congestion, child->winSize);
+    if (child->fecGroup > 0) {
+        initFecEncoder(&child->fec, child->fecGroup, child->fecParity, child->bufSize, child->winSize);
+    }
+    child->done = false;
+
+    // ----- Initial Window of Packets -----
+    printf("----- CHILD: SENDING DATA (INITIAL)-----\n");
+    sendNewData(child);
+    flushOutput();
+    readAhead(child);
+
+    restartTimer(child);
+    return 0;
+}
+
+void sessionReadable(ChildContext *child){
+    uint8_t buffers[RECV_BATCH_MAX][MAX_PDU_SIZE];
+    int lens[RECV_BATCH_MAX];
+    struct sockaddr_in6 srcs[RECV_BATCH_MAX];
+
+    // Zero when the wakeup was only zerocopy completions, which mustn't count
+    // as hearing from the client
+    int count = recvPdus(child->socketNum, buffers, lens, RECV_BATCH_MAX, srcs);
+    if (count == 0) {
+        return;
+    }
+    child->client = srcs[count - 1];
+    handleControlBatch(child, buffers, lens, count);
+}
+
+void handleControlBatch(ChildContext *child, uint8_t (*buffers)[MAX_PDU_SIZE], int *lens, int count){
+    child->attempts = 0;
+    uint64_t oldBase = child->base;
+    int resent = 0;
+
+    // RRs are cumulative, and so is an SREJ for the packet it names, so only
+    // the highest of them in the batch needs to slide the window. It goes
+    // first, which also lets SREJs it covers be skipped instead of resent.
+    bool valid[RECV_BATCH_MAX];
+    bool haveRR = false;
+    uint64_t maxRR = 0;
+    for (int i = 0; i < count; i++) {
+        valid[i] = validControlPdu(child, buffers[i], lens[i]);
+        if (!valid[i]) {
+            continue;
+        }
+        pdu_header header;
+        memcpy(&header, buffers[i], sizeof(pdu_header));
+        uint64_t ackSeq = pduSeq(buffers[i], child->wideSeq);
+        if ((header.flag == 5 || header.flag == 6) && (!haveRR || ackSeq > maxRR)) {
+            maxRR = ackSeq;
+            haveRR = true;
+        }
+    }
+    if (haveRR && maxRR > child->base) {
+        applyRR(child, maxRR);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!valid[i]) {
+            continue;
+        }
+        pdu_header header;
+        memcpy(&header, buffers[i], sizeof(pdu_header));
+        uint64_t ackSeq = pduSeq(buffers[i], child->wideSeq);
+        int hdrLen = headerSize(child->wideSeq);
+
+        int payloadLen = lens[i] - hdrLen;
+        if (header.flag == 5 && child->fecGroup > 0 && payloadLen >= FEC_REPORT_SIZE) {
+            uint32_t repaired;
+            payloadLen -= FEC_REPORT_SIZE;
+            memcpy(&repaired, buffers[i] + hdrLen + payloadLen, sizeof(repaired));
+            fecRepaired(&child->fec, ntohl(repaired));
+        }
+
+        if (header.flag == 5 && child->sack) {
+            applySack(child, ackSeq, buffers[i] + hdrLen, payloadLen);
+        } else if (header.flag == 6) {  // SREJ
+            resent += applySREJ(child, ackSeq);
+        } else if (header.flag == 10) {  // EOF ACK
+            printf("EOF_ACK: Received for seq=%llu\n", (unsigned long long)ackSeq);
+            child->eofAcked = true;
+            child->done = true;
+        }
+    }
+    if (child->sack) {
+        resent += resendHoles(child);
+    }
+
+    // An RR that neither slides the window nor uncovers a loss is the
+    // client's own timer firing, and mustn't hold off ours
+    if (resent > 0 || child->base != oldBase) {
+        restartTimer(child);
+    }
+    flushOutput();
+}
+
+// Checksum and session ID; logs PDUs that belong to another session.
+static bool validControlPdu(ChildContext *child, uint8_t *buffer, int recvLen){
+    if (recvLen < headerSize(child->wideSeq) || in_cksum((unsigned short *)buffer, recvLen)) {
+        return false;
+    }
+    pdu_header header;
+    memcpy(&header, buffer, sizeof(pdu_header));
+    if (ntohl(header.session) != child->sessionId) {
+        printf("Control PDU for session %u on session %u, ignoring\n", ntohl(header.session), child->sessionId);
+        return false;
+    }
+    return true;
+}
+
+static void applyRR(ChildContext *child, uint64_t ackSeq){
+    WindowBuffer *wb = &child->wb;
+    if (ackSeq <= child->base) {
+        printf("RR: Duplicate/Old ack=%llu (current base=%llu)\n",
+               (unsigned long long)ackSeq, (unsigned long long)child->base);
+        return;
+    }
+    if (ackSeq > child->nextSeq) {
+        printf("RR: ack=%llu beyond next seq %llu, ignoring\n",
+               (unsigned long long)ackSeq, (unsigned long long)child->nextSeq);
+        return;
+    }
+
+    printf("RR: ack=%llu (moving window: %llu → %llu)\n", (unsigned long long)ackSeq,
+           (unsigned long long)child->base, (unsigned long long)ackSeq);
+    uint64_t rttUs = sampleRtt(child, child->base, ackSeq);
+    congestionAcked(&child->cc, ackSeq - child->base, ackSeq, getTimeMs(), child->rtt.srttUs);
+
+    // Packets already SACKed were counted as delivered then
+    uint32_t delivered = 0;
+    SendSlot *newest = NULL;
+    for (uint64_t seq = child->base; seq < ackSeq; seq++) {
+        SendSlot *slot = &child->slots[seq % wb->window_size];
+        if (!slot->held) {
+            delivered++;
+            newest = slot;
+        }
+    }
+    if (newest) {
+        congestionDelivered(&child->cc, delivered, &newest->stamp, rttUs, child->nextSeq - ackSeq, getTimeUs());
+    }
+
+    releaseCachedBlocks(child, child->base, ackSeq);
+    slide_window(wb, ackSeq - child->base); child->base = ackSeq;
+    limitSessionWindow(child, child->sendWindow);   // finish a pending shrink
+
+    // Send more packets if window opened
+    sendNewData(child);
+    readAhead(child);
+}
+
+// Returns the number of packets resent, 0 or 1.
+static int applySREJ(ChildContext *child, uint64_t ackSeq){
+    WindowBuffer *wb = &child->wb;
+    if (ackSeq < child->base || ackSeq >= child->nextSeq) {
+        printf("SREJ: seq=%llu outside window [%llu, %llu)\n", (unsigned long long)ackSeq,
+               (unsigned long long)child->base, (unsigned long long)child->nextSeq);
+        return 0;
+    }
+    printf("SREJ: Resending packet seq=%llu\n", (unsigned long long)ackSeq);
+    bool isEOF = child->eofSent && ackSeq == child->eofSeq;
+    send_data_packet(child, wb, ackSeq, isEOF, isEOF ? child->eofLen : wb->buffer_size);
+    child->slots[ackSeq % wb->window_size].sentUs = 0;
+    congestionLoss(&child->cc, ackSeq, child->nextSeq, getTimeMs());
+    fecLoss(&child->fec);
+    return 1;
+}
+
+// Marks the packets an RR's bitmap says the client holds. The newest one
+// held for the first time is timed, if it was never resent.
+static void applySack(ChildContext *child, uint64_t ackSeq, const uint8_t *bitmap, int len){
+    if (len > SACK_MAX_BYTES) {
+        len = SACK_MAX_BYTES;
+    }
+    uint32_t delivered = 0;
+    SendSlot *newest = NULL;
+    for (int i = 0; i < len * 8; i++) {
+        uint64_t seq = ackSeq + 1 + i;
+        if ((bitmap[i / 8] & (1 << (i % 8))) && seq >= child->base && seq < child->nextSeq) {
+            SendSlot *slot = &child->slots[seq % child->wb.window_size];
+            if (!slot->held) {
+                delivered++;
+                newest = slot;
+            }
+            slot->held = true;
+        }
+    }
+    if (newest == NULL) {
+        return;
+    }
+
+    uint64_t now = getTimeUs();
+    uint64_t rttUs = 0;
+    if (newest->sentUs != 0) {
+        rttUs = now - newest->sentUs;
+        addRttSample(&child->rtt, rttUs);
+    }
+    congestionDelivered(&child->cc, delivered, &newest->stamp, rttUs, child->nextSeq - child->base - delivered, now);
+}
+
+// Karn's rule: an ack for a range with a resent packet in it can't say which
+// copy it answers, so only ranges of first transmissions are timed, by
+// their last packet. One already timed through its SACK isn't timed again.
+// Returns the sample, 0 if none was taken.
+static uint64_t sampleRtt(ChildContext *child, uint64_t from, uint64_t to){
+    for (uint64_t seq = from; seq < to; seq++) {
+        if (child->slots[seq % child->wb.window_size].sentUs == 0) {
+            return 0;
+        }
+    }
+    SendSlot *last = &child->slots[(to - 1) % child->wb.window_size];
+    if (last->held) {
+        return 0;
+    }
+    uint64_t rttUs = getTimeUs() - last->sentUs;
+    addRttSample(&child->rtt, rttUs);
+    return rttUs;
+}
+
+// Everything unheld below the highest SACKed packet is missing, as is its
+// last copy once a packet sent after that copy has been SACKed. Those holes
+// are resent; one whose copy may still arrive is left to later SACKs.
+static int resendHoles(ChildContext *child){
+    WindowBuffer *wb = &child->wb;
+    uint64_t high = child->nextSeq;
+    while (high > child->base && !child->slots[(high - 1) % wb->window_size].held) {
+        high--;
+    }
+
+    int holes = 0;
+    for (uint64_t seq = child->base; seq < high; seq++) {
+        SendSlot *slot = &child->slots[seq % wb->window_size];
+        if (!slot->held && high > slot->resendAfter) {
+            bool isEOF = child->eofSent && seq == child->eofSeq;
+            send_data_packet(child, wb, seq, isEOF, isEOF ? child->eofLen : wb->buffer_size);
+            slot->sentUs = 0;
+            slot->resendAfter = child->nextSeq;
+            congestionLoss(&child->cc, seq, child->nextSeq, getTimeMs());
+            fecLoss(&child->fec);
+            holes++;
+        }
+    }
+    if (holes > 0) {
+        printf("SACK: Resent %d holes below %llu\n", holes, (unsigned long long)high);
+    }
+    return holes;
+}
+
+// The client may hold its RR back for its ack delay, which the RTO can't
+// see in its samples before it has any.
+static void restartTimer(ChildContext *child){
+    child->deadline = getTimeMs() + currentRto(&child->rtt) + child->ackDelayMs;
+}
+
+// Packets the session may have outstanding: its congestion window, never
+// more than the client's window as the memory budget has limited it.
+static uint32_t sendLimit(ChildContext *child){
+    uint32_t cwnd = congestionWindow(&child->cc);
+    return cwnd < child->sendWindow ? cwnd : child->sendWindow;
+}
+
+// The next packet a timeout left to resend, past the ones the client has
+// since acknowledged or SACKed. Returns false once there are none.
+static bool rewindPending(ChildContext *child){
+    if (child->rewindSeq < child->base) {
+        child->rewindSeq = child->base;
+    }
+    while (child->rewindSeq < child->rewindEnd && child->slots[child->rewindSeq % child->wb.window_size].held) {
+        child->rewindSeq++;
+    }
+    return child->rewindSeq < child->rewindEnd;
+}
+
+// Sends packets while the window has room: first those a timeout left to
+// resend, then new ones. Under a pacing rate they leave a quantum at a
+// time, the next quantum due once the last one has drained at that rate;
+// until then the rest wait for sessionPace() and the owner's pace timer.
+static void sendNewData(ChildContext *child){
+    double rate = child->cc.pacingRate;
+    uint64_t now = rate > 0 ? getTimeUs() : 0;
+    uint32_t quantum = rate > 0 ? pacingQuantum(&child->cc) : 0;
+    uint32_t burst = 0;
+    child->paceWaiting = false;
+
+    for (;;) {
+        // Packets past rewindSeq were presumed lost, so aren't outstanding
+        bool rewind = rewindPending(child);
+        uint64_t seq = rewind ? child->rewindSeq : child->nextSeq;
+        if (seq >= child->base + sendLimit(child) || (!rewind && child->eofSent)) {
+            return;
+        }
+        if (rate > 0) {
+            if (burst == quantum || (burst == 0 && child->paceAtUs > now + PACE_SLACK_US)) {
+                child->paceWaiting = true;
+                return;
+            }
+            if (child->paceAtUs < now) {
+                child->paceAtUs = now;   // time spent idle isn't credit for a bigger burst
+            }
+            child->paceAtUs += (uint64_t)(1000000 / rate);
+            burst++;
+        }
+        if (rewind) {
+            bool isEOF = child->eofSent && seq == child->eofSeq;
+            send_data_packet(child, &child->wb, seq, isEOF, isEOF ? child->eofLen : child->wb.buffer_size);
+            child->slots[seq % child->wb.window_size].sentUs = 0;
+            child->rewindSeq++;
+        } else {
+            send_next_data(child, &child->wb, &child->nextSeq, &child->eofSent, &child->eofSeq, child->file);
+        }
+    }
+}
+
+// Every transmission of seq, first or not, for the delivery rate samples.
+static void stampSend(ChildContext *child, uint64_t seq){
+    bool appLimited = child->eofSent || child->sendWindow < congestionWindow(&child->cc);
+    congestionSent(&child->cc, &child->slots[seq % child->wb.window_size].stamp,
+                   child->nextSeq - child->base, appLimited, getTimeUs());
+}
+
+void sessionPace(ChildContext *child){
+    sendNewData(child);
+    flushOutput();
+    readAhead(child);
+}
+
+// Moves the slots of the packets in flight to a window of the new size.
+static void resizeSlots(ChildContext *child, uint32_t oldSize){
+    SendSlot *slots = sCalloc(child->wb.window_size, sizeof(SendSlot));
+    for (uint64_t seq = child->base; seq < child->nextSeq; seq++) {
+        slots[seq % child->wb.window_size] = child->slots[seq % oldSize];
+    }
+    free(child->slots);
+    child->slots = slots;
+}
+
+void limitSessionWindow(ChildContext *child, uint32_t window){
+    if (window < child->sendWindow) {
+        printf("Session %u window limited: %u -> %u\n", child->sessionId, child->sendWindow, window);
+        child->sendWindow = window;
+    }
+
+    // Memory is only given back once the packets still in flight fit the
+    // smaller buffer, since panes are indexed by seq % window_size.
+    if (child->sendWindow < child->wb.window_size && child->nextSeq - child->base <= child->sendWindow) {
+        uint32_t oldSize = child->wb.window_size;
+        if (child->cached) {
+            CacheBlock **blocks = sCalloc(child->sendWindow, sizeof(CacheBlock *));
+            for (uint64_t seq = child->base; seq < child->nextSeq; seq++) {
+                blocks[seq % child->sendWindow] = child->blocks[seq % child->wb.window_size];
+            }
+            free(child->blocks);
+            child->blocks = blocks;
+            child->wb.window_size = child->sendWindow;
+        } else if (child->mapped) {
+            child->wb.window_size = child->sendWindow;   // no panes to move
+        } else {
+            if (child->zeroCopy) {
+                // The old panes can't be freed while the kernel still sends from them
+                flushPdus();
+                waitZeroCopy(child->socketNum, zeroCopyMark(child->socketNum));
+            }
+            resize_window(&child->wb, child->sendWindow, child->base, child->nextSeq);
+        }
+        resizeSlots(child, oldSize);
+        child->winSize = child->wb.window_size;
+    }
+}
+
+void sessionTimeout(ChildContext *child){
+    child->attempts++;
+    if (child->attempts >= MAX_ATTEMPTS) {
+        printf("Client unresponsive after %d attempts, ending session\n", child->attempts);
+        child->done = true;
+        return;
+    }
+    backoffRto(&child->rtt);
+    congestionTimeout(&child->cc, child->nextSeq, getTimeMs());
+    fecLoss(&child->fec);
+    printf("Session %u RTO backed off to %u ms\n", child->sessionId, currentRto(&child->rtt));
+    retransmit_packets(child, &child->wb, child->base, child->nextSeq);
+    restartTimer(child);
+}
+
+void finishTransfer(ChildContext *child){
+    if (child->uring) {
+        // The ring still points into this session until its requests complete
+        child->done = true;
+        reapSessionUring();   // drops its requests still in the backlog
+        while (child->uringPending > 0 && uringSubmit(threadRing, 1) >= 0) {
+            reapSessionUring();
+        }
+        close(child->fd);
+        free_window(&child->wb);
+        child->uring = false;
+    }
+    if (child->file) {
+        if (child->zeroCopy) {
+            flushPdus();
+            waitZeroCopy(child->socketNum, zeroCopyMark(child->socketNum));
+            child->zeroCopy = false;
+        }
+        fclose(child->file);
+        free_window(&child->wb);
+        child->file = NULL;
+    }
+    if (child->mapped) {
+        if (child->mapLen > 0) {
+            munmap((void *)child->map, child->mapLen);
+        }
+        child->map = NULL;
+        child->mapLen = 0;
+        child->mapped = false;
+    }
+    if (child->cached) {
+        releaseCachedBlocks(child, child->base, child->nextSeq);
+        free(child->blocks);
+        close(child->fd);
+        child->blocks = NULL;
+        child->cached = false;
+        if (g_sessionStats) {
+            printCacheStats(g_blockCache);
+        }
+    }
+    if (g_sessionStats && child->slots && child->rtt.sampled) {
+        printf("Session %u: SRTT %.3f ms, RTTVAR %.3f ms, RTO %u ms\n", child->sessionId,
+               child->rtt.srttUs / 1000.0, child->rtt.rttvarUs / 1000.0, currentRto(&child->rtt));
+    }
+    free(child->slots);
+    child->slots = NULL;
+    freeFecEncoder(&child->fec);
+    if (child->ownsSocket && child->socketNum >= 0) {
+        if (g_sessionStats) {
+            printZeroCopyStats(child->socketNum);
+        }
+        closeZeroCopy(child->socketNum);
+        close(child->socketNum);
+    }
+    child->socketNum = -1;
+    child->ownsSocket = false;
+}
+
+void send_data_packet(ChildContext *child, WindowBuffer *wb, uint64_t seq, bool isEOF, size_t bytesRead) {
+    pdu_header header = {
+        .flag = isEOF ? 10 : 16,  // 10=EOF, 16=data
+        .checksum = 0,
+        .session = htonl(child->sessionId)
+    };
+
+    if (child->uring && wb->panes[seq % wb->window_size].seq_num != seq) {
+        return;   // still being read, it goes out when the read completes
+    }
+
+    printf("SEND: seq=%llu, flag=%d, %s\n", (unsigned long long)seq, header.flag, isEOF ? "EOF" : "DATA");
+    stampSend(child, seq);
+
+    int hdrLen = headerSize(child->wideSeq);
+    if (child->zeroCopy) {
+        // Built when the block was read, so retransmissions send the same bytes
+        pane *slot = &wb->panes[seq % wb->window_size];
+        queuePduInPlace(child->socketNum, &child->client, slot->data - hdrLen, hdrLen + bytesRead, &slot->zc_mark);
+        return;
+    }
+
+    // Use actual bytesRead instead of wb->buffer_size
+    queueSeqPdu(child->socketNum, &child->client, header, seq, child->wideSeq,
+                (const char *)blockData(child, seq), bytesRead);
+}
+
+void send_next_data(ChildContext *child, WindowBuffer *wb, uint64_t *nextSeq,
+                   bool *eofSent, uint64_t *eofSeq, FILE *file) {
+    size_t bytesRead;
+    bool lastBlock;
+    if (child->mapped) {
+        uint64_t offset = *nextSeq * wb->buffer_size;
+        size_t left = offset < child->mapLen ? child->mapLen - offset : 0;
+        bytesRead = left < wb->buffer_size ? left : wb->buffer_size;
+        lastBlock = bytesRead < wb->buffer_size;
+    } else if (child->cached) {
+        CacheBlock *block = acquireBlock(g_blockCache, &child->version, child->fd, wb->buffer_size, *nextSeq);
+        if (block == NULL) {
+            fprintf(stderr, "Read of block %llu failed, ending session\n", (unsigned long long)*nextSeq);
+            child->done = true;
+            *eofSent = true;   // stops the caller's send loop
+            return;
+        }
+        child->blocks[*nextSeq % wb->window_size] = block;
+        bytesRead = block->len;
+        lastBlock = bytesRead < wb->buffer_size;
+    } else if (child->uring) {
+        uint64_t offset = *nextSeq * wb->buffer_size;
+        uint64_t left = offset < child->fileSize ? child->fileSize - offset : 0;
+        bytesRead = left < wb->buffer_size ? left : wb->buffer_size;
+        lastBlock = bytesRead < wb->buffer_size;
+    } else {
+        if (child->zeroCopy) {
+            waitZeroCopy(child->socketNum, wb->panes[*nextSeq % wb->window_size].zc_mark);
+        }
+        bytesRead = fread(wb->panes[*nextSeq % wb->window_size].data, 1, wb->buffer_size, file);
+        wb->panes[*nextSeq % wb->window_size].seq_num = *nextSeq;
+        lastBlock = bytesRead < wb->buffer_size || feof(file);
+    }
+
+    // A short read is the last block of the file, so it travels as the EOF
+    // packet itself rather than as a data packet followed by an empty EOF.
+    if (lastBlock) {
+        *eofSent = true;
+        *eofSeq = *nextSeq;
+        child->eofLen = bytesRead;
+        printf("EOF DETECTED at seq=%llu (read %zu bytes)\n", (unsigned long long)*nextSeq, bytesRead);
+    }
+
+    if (child->zeroCopy) {
+        bool isEOF = *eofSent && *nextSeq == *eofSeq;
+        pdu_header header = {
+            .flag = isEOF ? 10 : 16,
+            .checksum = 0,
+            .session = htonl(child->sessionId)
+        };
+        buildSeqPdu(wb->panes[*nextSeq % wb->window_size].data - headerSize(child->wideSeq), header,
+                    *nextSeq, child->wideSeq, NULL, bytesRead);
+    }
+
+    child->slots[*nextSeq % wb->window_size] = (SendSlot){
+        .sentUs = getTimeUs(), .held = false, .resendAfter = *nextSeq + 1
+    };
+
+    if (child->uring) {
+        submitBlockRead(child, *nextSeq, bytesRead);   // sent once the read completes
+    } else {
+        send_data_packet(child, wb, *nextSeq, *eofSent && (*nextSeq == *eofSeq), bytesRead);
+        if (!lastBlock) {
+            sendParity(child, *nextSeq, blockData(child, *nextSeq));
+        }
+    }
+    (*nextSeq)++;
+}
+
+void retransmit_packets(ChildContext *child, WindowBuffer *wb, uint64_t base, uint64_t nextSeq) {
+    printf("TIMEOUT: Retransmitting packets seq=%llu to %llu as the window allows\n",
+           (unsigned long long)base, (unsigned long long)nextSeq - 1);
+
+    // SACKs leave these to the rewind until something newer is SACKed
+    for (uint64_t i = base; i < nextSeq; i++) {
+        child->slots[i % wb->window_size].resendAfter = nextSeq;
+    }
+    child->rewindSeq = base;
+    child->rewindEnd = nextSeq;
+    sendNewData(child);
+    flushOutput();
+}
+
+// Payload for seq: its pane, or its place in the mapping.
+static const uint8_t *blockData(ChildContext *child, uint64_t seq){
+    if (child->mapped) {
+        uint64_t offset = seq * child->bufSize;
+        return offset < child->mapLen ? child->map + offset : NULL;
+    }
+    if (child->cached) {
+        return child->blocks[seq % child->wb.window_size]->data;
+    }
+    return child->wb.panes[seq % child->wb.window_size].data;
+}
+
+static int openCachedFile(ChildContext *child){
+    if (g_blockCache == NULL) {
+        return -1;
+    }
+    child->fd = open(child->filename, O_RDONLY);
+    if (child->fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(child->fd, &st) < 0) {
+        perror("fstat");
+        close(child->fd);
+        return -1;
+    }
+    child->version.dev = st.st_dev;
+    child->version.ino = st.st_ino;
+    child->version.size = st.st_size;
+    child->version.mtime = st.st_mtim;
+    checkFileVersion(g_blockCache, &child->version);
+
+    child->blocks = sCalloc(child->winSize, sizeof(CacheBlock *));
+    child->cached = true;
+    return 0;
+}
+
+// Unpins the blocks of [from, to), which the client has acknowledged.
+static void releaseCachedBlocks(ChildContext *child, uint64_t from, uint64_t to){
+    if (!child->cached) {
+        return;
+    }
+    for (uint64_t seq = from; seq < to; seq++) {
+        CacheBlock **slot = &child->blocks[seq % child->wb.window_size];
+        if (*slot) {
+            releaseBlock(g_blockCache, *slot);
+            *slot = NULL;
+        }
+    }
+}
+
+int sessionUringFd(void){
+    Uring *ring = g_senderMode == SENDER_URING ? sessionRing() : NULL;
+    return ring ? ring->fd : -1;
+}
+
+void reapSessionUring(void){
+    if (threadRing == NULL) {
+        return;
+    }
+    void *userData;
+    int res;
+    while (uringCompletion(threadRing, &userData, &res)) {
+        uringComplete(userData, res);
+    }
+    drainBacklog();
+    flushOutput();
+}
+
+// Sends whatever the session code queued: the sendmmsg() batch and any
+// reads and sends waiting in the ring, in one io_uring_enter().
+static void flushOutput(void){
+    flushPdus();
+    if (threadRing) {
+        uringSubmit(threadRing, 0);
+    }
+}
+
+static Uring *sessionRing(void){
+    if (threadRing == NULL && !threadRingFailed) {
+        Uring *ring = sCalloc(1, sizeof(Uring));
+        if (initUring(ring, URING_ENTRIES) == 0) {
+            threadRing = ring;
+        } else {
+            fprintf(stderr, "io_uring unavailable in this thread, sessions fall back to fread\n");
+            threadRingFailed = true;
+            free(ring);
+        }
+    }
+    return threadRing;
+}
+
+static int openUringFile(ChildContext *child){
+    if (sessionRing() == NULL) {
+        return -1;
+    }
+    child->fd = open(child->filename, O_RDONLY);
+    if (child->fd < 0) {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(child->fd, &st) < 0) {
+        perror("fstat");
+        close(child->fd);
+        return -1;
+    }
+    child->fileSize = st.st_size;
+    child->uringPending = 0;
+    child->uring = true;
+    return 0;
+}
+
+// Puts a request on the ring, or behind the ones already waiting for room
+// when the ring is full; reapSessionUring() moves them on as completions
+// free it up.
+static void startRequest(UringRequest *req){
+    if (backlogHead == NULL && prepRequest(req)) {
+        return;
+    }
+    req->next = NULL;
+    if (backlogTail) {
+        backlogTail->next = req;
+    } else {
+        backlogHead = req;
+    }
+    backlogTail = req;
+}
+
+static bool prepRequest(UringRequest *req){
+    struct io_uring_sqe *sqe = uringSqe(threadRing);
+    if (sqe == NULL && uringSubmit(threadRing, 0) >= 0) {
+        sqe = uringSqe(threadRing);   // the submission queue was only full
+    }
+    if (sqe == NULL) {
+        return false;
+    }
+    ChildContext *child = req->child;
+    if (req->sending) {
+        uringPrepSendmsg(sqe, child->socketNum, &req->msg, req);
+    } else {
+        uringPrepRead(sqe, child->fd, req->packet + headerSize(child->wideSeq) + req->got, req->len - req->got,
+                      req->seq * child->wb.buffer_size + req->got, req);
+    }
+    return true;
+}
+
+static void drainBacklog(void){
+    while (backlogHead) {
+        UringRequest *req = backlogHead;
+        if (!req->child->done && !prepRequest(req)) {
+            return;
+        }
+        backlogHead = req->next;
+        if (backlogHead == NULL) {
+            backlogTail = NULL;
+        }
+        if (req->child->done) {
+            req->child->uringPending--;
+            free(req);
+        }
+    }
+}
+
+static void submitBlockRead(ChildContext *child, uint64_t seq, size_t len){
+    int hdrLen = headerSize(child->wideSeq);
+    UringRequest *req = sCalloc(1, sizeof(UringRequest) + hdrLen + child->wb.buffer_size);
+    req->child = child;
+    req->seq = seq;
+    req->len = len;
+    child->uringPending++;
+    startRequest(req);
+}
+
+// A read finished: keep the block for retransmissions, finish the packet
+// around it and send it from the same buffer. A send finished: done.
+static void uringComplete(UringRequest *req, int res){
+    ChildContext *child = req->child;
+    if (!req->sending && res < 0) {
+        fprintf(stderr, "Read of block %llu failed: %s, ending session\n",
+                (unsigned long long)req->seq, strerror(-res));
+        child->done = true;
+    } else if (req->sending && res < 0) {
+        fprintf(stderr, "io_uring send of seq %llu failed: %s\n", (unsigned long long)req->seq, strerror(-res));
+        if (res == -EMSGSIZE) {
+            allowFragmentation(child->socketNum);   // the retransmission fits
+        }
+    }
+    if (!req->sending && res == 0 && req->got < req->len && !child->done) {
+        fprintf(stderr, "File ended inside block %llu, ending session\n", (unsigned long long)req->seq);
+        child->done = true;
+    }
+    if (req->sending || res < 0 || child->done) {
+        child->uringPending--;
+        free(req);
+        return;
+    }
+
+    // A short read: read the rest of the block before it goes anywhere
+    req->got += res;
+    if (req->got < req->len) {
+        startRequest(req);
+        return;
+    }
+    res = req->len;
+
+    WindowBuffer *wb = &child->wb;
+    pane *slot = &wb->panes[req->seq % wb->window_size];
+    memcpy(slot->data, req->packet + headerSize(child->wideSeq), res);
+    slot->seq_num = req->seq;
+
+    bool isEOF = child->eofSent && req->seq == child->eofSeq;
+    if (!pduBatchingAllowed()) {
+        // Sends have to go through sendtoErr(), only the read was asynchronous
+        send_data_packet(child, wb, req->seq, isEOF, res);
+        if (!isEOF) {
+            sendParity(child, req->seq, slot->data);
+        }
+        child->uringPending--;
+        free(req);
+        return;
+    }
+
+    pdu_header header = {
+        .flag = isEOF ? 10 : 16,
+        .checksum = 0,
+        .session = htonl(child->sessionId)
+    };
+    printf("SEND: seq=%llu, flag=%d, %s\n", (unsigned long long)req->seq, header.flag, isEOF ? "EOF" : "DATA");
+    stampSend(child, req->seq);
+    int len = buildSeqPdu(req->packet, header, req->seq, child->wideSeq, NULL, res);
+    uint64_t seq = req->seq;
+    submitSend(req, len);
+    if (!isEOF) {
+        sendParity(child, seq, slot->data);
+    }
+}
+
+// Sends the len bytes built in req->packet from the ring, unless the
+// thread's ErrorSim drops them.
+static void submitSend(UringRequest *req, int len){
+    ChildContext *child = req->child;
+    ErrorSim *sim = currentErrorSim();
+    if (sim && !simulateErrors(sim, req->packet, len)) {
+        child->uringPending--;
+        free(req);
+        return;
+    }
+
+    req->sending = true;
+    req->iov.iov_base = req->packet;
+    req->iov.iov_len = len;
+    req->msg.msg_name = &child->client;
+    req->msg.msg_namelen = sizeof(child->client);
+    req->msg.msg_iov = &req->iov;
+    req->msg.msg_iovlen = 1;
+    startRequest(req);
+}
+
+// Sums a block's first transmission into its parity group and, once that
+// completes the group, sends the group's parity packets. Ring sessions send
+// them from the ring too, behind the block.
+//
+// Parity has no sequence number of its own and is never acked or resent, so
+// it can't be part of the ack-clocked window: counting it as outstanding
+// would hold cwnd open with packets no ack ever releases. It is bounded by
+// the K/N the encoder chose instead. Under a pacing rate it does take its
+// time slots, so a group plus its parity leaves at the rate the model allows.
+static void sendParity(ChildContext *child, uint64_t seq, const uint8_t *data){
+    if (child->fecGroup == 0) {
+        return;
+    }
+    int ready = fecEncode(&child->fec, seq, data);
+    double rate = child->cc.pacingRate;
+    if (ready > 0 && rate > 0) {
+        uint64_t now = getTimeUs();
+        if (child->paceAtUs < now) {
+            child->paceAtUs = now;
+        }
+        child->paceAtUs += (uint64_t)(ready * 1000000 / rate);
+    }
+    pdu_header header = {
+        .flag = 17,   // parity
+        .checksum = 0,
+        .session = htonl(child->sessionId)
+    };
+    int len = FEC_HEADER_SIZE + child->bufSize;
+    for (int j = 0; j < ready; j++) {
+        const char *payload = (const char *)fecParity(&child->fec, j);
+        if (child->uring && pduBatchingAllowed()) {
+            UringRequest *req = sCalloc(1, sizeof(UringRequest) + headerSize(child->wideSeq) + len);
+            req->child = child;
+            req->seq = child->fec.group;
+            child->uringPending++;
+            submitSend(req, buildSeqPdu(req->packet, header, child->fec.group, child->wideSeq, payload, len));
+        } else {
+            queueSeqPdu(child->socketNum, &child->client, header, child->fec.group, child->wideSeq, payload, len);
+        }
+    }
+    if (ready > 0) {
+        printf("FEC: sent %d parity packets for seq=%llu..%llu\n", ready, (unsigned long long)child->fec.group,
+               (unsigned long long)seq);
+    }
+}
+
+// Keeps the next g_readAheadWindows windows of the file on their way into
+// the page cache, so the reads an RR triggers are memory copies rather than
+// disk waits. The kernel is asked a window at a time, once less than a
+// window's worth of the read-ahead is left.
+static void readAhead(ChildContext *child){
+    uint32_t window = child->sendWindow;
+    if (g_readAheadWindows == 0 || child->eofSent || window == 0) {
+        return;
+    }
+    if (child->prefetchSeq < child->nextSeq) {
+        child->prefetchSeq = child->nextSeq;
+    }
+    uint64_t target = child->nextSeq + (uint64_t)g_readAheadWindows * window;
+    if (child->prefetchSeq + window > target) {
+        return;
+    }
+
+    uint64_t offset = child->prefetchSeq * child->bufSize;
+    uint64_t len = (target - child->prefetchSeq) * child->bufSize;
+    if (child->mapped) {
+        if (offset < child->mapLen) {
+            // madvise() wants a page-aligned start
+            uint64_t start = offset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+            uint64_t end = offset + len < child->mapLen ? offset + len : child->mapLen;
+            madvise((void *)(child->map + start), end - start, MADV_WILLNEED);
+        }
+    } else {
+        int fd = child->file ? fileno(child->file) : child->fd;
+        posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+    child->prefetchSeq = target;
+}
+
+static int mapFile(ChildContext *child){
+    int fd = open(child->filename, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    // An empty file can't be mapped; it is sent as a lone empty EOF packet
+    child->map = NULL;
+    child->mapLen = st.st_size;
+    if (child->mapLen > 0) {
+        void *map = mmap(NULL, child->mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+        madvise(map, child->mapLen, MADV_SEQUENTIAL);
+        child->map = map;
+    }
+    close(fd);   // the mapping stays valid
+    child->mapped = true;
+    return 0;
+}
+
+uint32_t allocSessionId(uint32_t *lastSessionId){
+    if (++(*lastSessionId) == 0) {
+        ++(*lastSessionId);   // 0 is reserved for "no session yet"
+    }
+    return *lastSessionId;
+}
+
+int processClient(ChildContext *child, int dataLen, char *buffer){
+    printf("----- CHILD: PRCESSING CLIENT -----\n");
+
+    if (parseFilenamePdu(child, dataLen, buffer) != 0) {
+        return -1;
+    }
+    return answerHandshake(child);
+}
+
+int parseFilenamePdu(ChildContext *child, int dataLen, char *buffer){
+    pdu_header header;
+    memcpy(&header, buffer, sizeof(pdu_header));
+
+    if (header.flag != 8) {
+        return -1;  // Unrecognized packet type
+    }
+
+    // Minimum size check
+    if (dataLen < (int)(sizeof(pdu_header) + 9)) {
+        fprintf(stderr, "Payload too short for filename packet\n");
+        return -1;
+    }
+
+    uint32_t *sizes_ptr = (uint32_t *)(buffer + sizeof(pdu_header));
+    child->winSize = ntohl(sizes_ptr[0]);
+    child->bufSize = ntohl(sizes_ptr[1]);
+
+    uint8_t name_len = buffer[sizeof(pdu_header) + 8];
+    int optOffset = sizeof(pdu_header) + 9 + name_len;
+    if (name_len > MAX_FILENAME || dataLen < optOffset) {
+        fprintf(stderr, "Bad filename length in filename packet\n");
+        return -1;
+    }
+    memcpy(child->filename, buffer + sizeof(pdu_header) + 9, name_len);
+    child->filename[name_len] = '\0';
+
+    if (child->winSize == 0 || child->bufSize == 0 || child->bufSize > MAX_BUFFER) {
+        fprintf(stderr, "Bad window (%u) or buffer (%u) size in filename packet\n", child->winSize, child->bufSize);
+        return -1;
+    }
+
+    // Packets never grow past what the path to the client carries whole;
+    // the "Ok" ACK reports the smaller size back
+    uint32_t pathLimit = pathPayload(&child->client);
+    if (child->bufSize > pathLimit) {
+        printf("Buffer size %u exceeds the path MTU, granting %u\n", child->bufSize, pathLimit);
+        child->bufSize = pathLimit;
+    }
+
+    // Options follow the filename; clients that send none get nonce 0 (no dedup)
+    uint8_t *opts = (uint8_t *)buffer + optOffset;
+    int optLen = dataLen - optOffset;
+    uint32_t nonce = 0;
+    child->nonce = 0;
+    if (findOption(opts, optLen, HS_OPT_NONCE, &nonce, sizeof(nonce)) == 0) {
+        child->nonce = ntohl(nonce);
+    }
+    child->sack = findOption(opts, optLen, HS_OPT_SACK, NULL, 0) == 0;
+    uint16_t ackFreq[2];
+    child->ackEvery = 0;
+    child->ackDelayMs = 0;
+    if (findOption(opts, optLen, HS_OPT_ACK_FREQ, ackFreq, sizeof(ackFreq)) == 0 && ntohs(ackFreq[0]) > 1) {
+        child->ackEvery = ntohs(ackFreq[0]);
+        child->ackDelayMs = ntohs(ackFreq[1]);
+    }
+
+    // A parity packet's index and count come out of the path's payload
+    child->fecGroup = 0;
+    if (g_fecGroup > 0 && findOption(opts, optLen, HS_OPT_FEC, NULL, 0) == 0) {
+        child->fecGroup = g_fecGroup;
+        child->fecParity = g_fecParity;
+        if (child->bufSize > pathLimit - FEC_HEADER_SIZE) {
+            child->bufSize = pathLimit - FEC_HEADER_SIZE;
+        }
+    }
+
+    // The compact header numbers 2^32 packets, the EOF packet among them,
+    // at the size granted so far. Past that the wide one takes the rest,
+    // and 4 more bytes of each payload, which only adds packets.
+    struct stat st;
+    child->wideSeq = false;
+    if (stat(child->filename, &st) == 0 && (uint64_t)st.st_size / child->bufSize + 1 > COMPACT_SEQ_LIMIT) {
+        if (findOption(opts, optLen, HS_OPT_SEQ64, NULL, 0) != 0) {
+            fprintf(stderr, "File \"%s\" needs more packets of %u bytes than the client can number\n",
+                    child->filename, child->bufSize);
+            return -1;
+        }
+        child->wideSeq = true;
+        uint32_t wideLimit = pathLimit - SEQ_HIGH_SIZE - (child->fecGroup > 0 ? FEC_HEADER_SIZE : 0);
+        if (child->bufSize > wideLimit) {
+            child->bufSize = wideLimit;
+        }
+    }
+    return 0;
+}
+
+int answerHandshake(ChildContext *child){
+    buildHandshakeAck(child);
+    if (resendHandshakeAck(child->socketNum, &child->client, child->sessionId, child->ackPayload, child->ackLen) < 0) {
+        fprintf(stderr, "ERROR: Failed to send %s\n", child->ackOk ? "Ok" : "Not Ok");
+        return -1;
+    }
+    return child->ackOk ? 0 : -1;
+}
+
+int buildHandshakeAck(ChildContext *child){
+    const char *msg = lookupFilename(child->filename) ? "Ok" : "Not Ok";
+    child->ackLen = strlen(msg);
+    memcpy(child->ackPayload, msg, child->ackLen);
+    child->ackOk = strcmp(msg, "Ok") == 0;
+
+    // An accepted request also reports the window the server granted
+    if (child->ackOk) {
+        uint32_t netWindow = htonl(child->winSize);
+        child->ackPayload[child->ackLen++] = '\0';
+        child->ackLen = appendOption((uint8_t *)child->ackPayload, child->ackLen,
+                                     HS_OPT_WINDOW, &netWindow, sizeof(netWindow));
+        uint32_t netPayload = htonl(child->bufSize);
+        child->ackLen = appendOption((uint8_t *)child->ackPayload, child->ackLen,
+                                     HS_OPT_PAYLOAD, &netPayload, sizeof(netPayload));
+        if (child->sack) {
+            child->ackLen = appendOption((uint8_t *)child->ackPayload, child->ackLen, HS_OPT_SACK, NULL, 0);
+        }
+        if (child->wideSeq) {
+            child->ackLen = appendOption((uint8_t *)child->ackPayload, child->ackLen, HS_OPT_SEQ64, NULL, 0);
+        }
+        // A group has to fit the window for the client to still hold its
+        // packets when the parity arrives
+        if (child->fecGroup > child->winSize) {
+            child->fecGroup = child->winSize;
+        }
+        if (child->fecParity >= child->fecGroup) {
+            child->fecGroup = 0;
+        }
+        if (child->fecGroup > 0) {
+            uint16_t fec[2] = {htons(child->fecGroup), htons(child->fecParity)};
+            child->ackLen = appendOption((uint8_t *)child->ackPayload, child->ackLen, HS_OPT_FEC, fec, sizeof(fec));
+        }
+        if (child->ackEvery > 0) {
+            // A window must still draw several RRs, or the sender would sit
+            // out the ack delay at the end of every one
+            uint32_t maxEvery = child->winSize / 4 > 1 ? child->winSize / 4 : 1;
+            if (maxEvery > ACK_EVERY_MAX) {
+                maxEvery = ACK_EVERY_MAX;
+            }
+            if (child->ackEvery > maxEvery) {
+                child->ackEvery = maxEvery;
+            }
+            if (child->ackDelayMs > ACK_DELAY_MAX_MS) {
+                child->ackDelayMs = ACK_DELAY_MAX_MS;
+            }
+            uint16_t ackFreq[2] = {htons(child->ackEvery), htons(child->ackDelayMs)};
+            child->ackLen = appendOption((uint8_t *)child->ackPayload, child->ackLen,
+                                         HS_OPT_ACK_FREQ, ackFreq, sizeof(ackFreq));
+        }
+    }
+    return child->ackOk ? 0 : -1;
+}
+
+int resendHandshakeAck(int socketNum, struct sockaddr_in6 *client, uint32_t sessionId,
+                       const char *ackPayload, int ackLen){
+    pdu_header ack = {.seq = htonl(0), .flag = 9, .checksum = 0, .session = htonl(sessionId)};
+    return sendPdu(socketNum, client, ack, ackPayload, ackLen);
+}
+
+int sendBusyAck(int socketNum, struct sockaddr_in6 *client, uint32_t retryMs){
+    // Status string, its NUL, then options, so plain strcmp readers still work
+    uint8_t payload[MAX_ACK_PAYLOAD];
+    int len = sizeof("Busy");
+    memcpy(payload, "Busy", len);
+    uint32_t netRetry = htonl(retryMs);
+    len = appendOption(payload, len, HS_OPT_RETRY_MS, &netRetry, sizeof(netRetry));
+    return resendHandshakeAck(socketNum, client, 0, (const char *)payload, len);
+}
+
+bool sameHandshake(const struct sockaddr_in6 *a, uint32_t nonceA,
+                   const struct sockaddr_in6 *b, uint32_t nonceB){
+    return nonceA != 0 && nonceA == nonceB
+        && a->sin6_port == b->sin6_port
+        && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+bool lookupFilename(const char *filename) {
+
+    if (access(filename, R_OK) == 0) {
+        printf("File \"%s\" found and readable.\n", filename);
+        return true;
+    } else {
+        printf("File \"%s\" not found or not readable.\n", filename);
+        return false;
+    }
+}
@@ -0,0 +1,211 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "windowBuffer.h"
+#include "helperFunctions.h"
+#include "blockCache.h"
+#include "congestion.h"
+#include "fec.h"
+
+#define MAX_ACK_PAYLOAD 64
+#define READ_AHEAD_DEFAULT 2   // windows of blocks kept prefetched past nextSeq
+#define PACE_SLACK_US 100      // a paced quantum due this soon goes out now, not on the next timer
+
+// ----- Sender Modes -----
+typedef enum {
+    SENDER_READ,   // fread each block into the window buffer
+    SENDER_MMAP,   // send and resend straight from a read-only mapping of the file
+    SENDER_CACHE,  // read through the process-wide block cache
+    SENDER_URING,  // read and send through the thread's io_uring, fread/sendto if unavailable
+} sender_mode_t;
+
+// ----- Send Slots -----
+// Per window slot: when its seq went out, for RTT and delivery rate
+// samples, and what the client's SACK bitmaps said about it.
+typedef struct {
+    uint64_t sentUs;        // first transmission, 0 once resent (Karn's rule)
+    bool held;              // SACKed: buffered at the client, never needs resending
+    uint64_t resendAfter;   // the last copy is presumed lost once a seq >= this is SACKed
+    DeliveryStamp stamp;    // latest transmission
+} SendSlot;
+
+// ----- Child Context Structure -----
+// One per file transfer. In fork mode a child process owns exactly one of
+// these; in event-loop mode the loop owns many and advances each one when
+// its socket is readable or its retransmit timer fires.
+typedef struct ChildContext {
+    int socketNum;
+    bool ownsSocket;       // false when multiplexed on the shared listen socket
+    uint32_t sessionId;    // stamped into every PDU of this session
+    double error_rate;
+    struct sockaddr_in6 client;
+    socklen_t clientAddrLen;
+    char filename[MAX_FILENAME + 1];
+    uint32_t winSize;
+    uint32_t bufSize;
+    bool eof;
+    bool srej;
+    int attempts;
+    char pduBuffer[MAX_PDU_SIZE + 1];  // Buffer to hold received PDU
+    int pduLen;                        // Length of the received PDU
+
+    // ----- Handshake -----
+    uint32_t nonce;                    // client-chosen, 0 if the client sent none
+    bool sack;                         // client acks with SACK bitmaps (HS_OPT_SACK)
+    uint16_t ackEvery;                 // HS_OPT_ACK_FREQ as granted, 0 if the client acks every batch
+    uint16_t ackDelayMs;
+    bool wideSeq;                      // data and control PDUs carry the wide header (HS_OPT_SEQ64)
+    uint16_t fecGroup;                 // HS_OPT_FEC as granted, 0 without parity packets
+    uint8_t fecParity;                 // most parity packets per group
+    char ackPayload[MAX_ACK_PAYLOAD];  // flag-9 reply, resent verbatim to duplicates
+    int ackLen;
+    bool ackOk;
+    bool admitted;                     // holds an admission reservation
+    uint64_t admittedBytes;            // window * buffer, counted against -b
+    uint64_t admittedMem;              // window panes, counted against the memory budget
+
+    // ----- Transfer state -----
+    FILE *file;
+    const uint8_t *map;    // SENDER_MMAP: the whole file, wb has no panes
+    size_t mapLen;
+    bool mapped;
+    int fd;                // SENDER_CACHE: file the blocks are read from
+    FileVersion version;
+    CacheBlock **blocks;   // SENDER_CACHE: pinned block per window slot
+    bool cached;
+    bool uring;            // SENDER_URING: blocks are read from fd asynchronously
+    uint64_t fileSize;
+    int uringPending;      // reads and sends still owned by the ring
+    uint64_t prefetchSeq;  // first block the kernel hasn't been asked to read ahead
+    bool zeroCopy;         // SENDER_READ panes are sent in place with MSG_ZEROCOPY
+    SendSlot *slots;       // one per window slot
+    RttEstimator rtt;      // drives deadline
+    CongestionControl cc;  // outstanding packets are kept under min(cwnd, sendWindow)
+    FecEncoder fec;        // parity of the group being sent, if fecGroup
+    uint64_t paceAtUs;     // when the next new packet is due under cc.pacingRate
+    bool paceWaiting;      // the window has room but the pacing rate holds packets back
+    uint64_t rewindSeq;    // after a timeout, the next old packet to resend as the window allows
+    uint64_t rewindEnd;    // nextSeq at the timeout, where resending stops
+    WindowBuffer wb;
+    uint64_t nextSeq;
+    uint64_t base;
+    uint32_t sendWindow;   // packets allowed outstanding, <= wb.window_size
+    uint64_t eofSeq;
+    uint32_t eofLen;       // payload bytes carried by the EOF packet
+    bool eofSent;
+    bool eofAcked;
+    uint64_t deadline;     // ms timestamp of the next retransmit timeout
+    bool done;             // transfer finished or gave up, ready to be reaped
+    struct ChildContext *idNext;   // event loop session-ID hash chain
+} ChildContext;
+
+// Server-wide choice of how sessions read the file, set once at startup.
+void setSenderMode(sender_mode_t mode);
+
+// Whether sessions copy their window into panes: all but mmap ones and
+// cache ones with a block cache to read through.
+bool sessionsUsePanes(void);
+
+// Congestion control every new session starts with (fixedCongestion unless set).
+void setCongestionControl(const CongestionOps *ops);
+
+// Parity groups offered to clients that can decode them: up to maxParity
+// parity packets per groupSize data packets. groupSize 0 (the default) sends none.
+void setFecGroups(uint16_t groupSize, uint8_t maxParity);
+
+// How many windows of blocks past nextSeq sessions ask the kernel to read
+// ahead, 0 to leave it to the kernel's own heuristics.
+void setReadAhead(uint32_t windows);
+
+// The cache SENDER_CACHE sessions read through.
+void setBlockCache(BlockCache *cache);
+
+// Print each session's statistics when it ends (off by default).
+void setSessionStats(bool enabled);
+
+// The calling thread's io_uring for SENDER_URING, set up on first use.
+// Returns its fd for the session loop's poll set, or -1 in other modes.
+int sessionUringFd(void);
+
+// The ring fd is readable: sends the blocks whose reads have finished and
+// frees the requests whose sends have.
+void reapSessionUring(void);
+
+// Opens a socket on an OS-chosen port for the session to talk to its client from.
+int openSessionSocket(ChildContext *child);
+
+// Opens the file named in an already acknowledged handshake and sends the
+// initial window. Returns 0 when the session has an active transfer.
+int beginTransfer(ChildContext *child);
+
+// Drains the control PDUs queued on the session socket and processes them.
+void sessionReadable(ChildContext *child);
+
+// Processes a batch of control PDUs in order, except that only the highest
+// RR in the batch is applied and it is applied first. SACK bitmaps are then
+// merged, and each hole below the highest packet held is resent unless its
+// last copy could still be on its way.
+void handleControlBatch(ChildContext *child, uint8_t (*buffers)[MAX_PDU_SIZE], int *lens, int count);
+
+// Lowers the number of packets the session keeps outstanding. The window
+// buffer itself shrinks once the outstanding packets fit.
+void limitSessionWindow(ChildContext *child, uint32_t window);
+
+// A paced session's next packets are due (paceWaiting and getTimeUs() has
+// reached paceAtUs, give or take PACE_SLACK_US): sends them.
+void sessionPace(ChildContext *child);
+
+// Retransmit timer expired: back off the RTO and resend the outstanding
+// window, less whatever the client has SACKed.
+void sessionTimeout(ChildContext *child);
+
+// Closes the file, frees the window and closes the session socket if it owns one.
+void finishTransfer(ChildContext *child);
+
+// Next nonzero session ID from the owner's counter.
+uint32_t allocSessionId(uint32_t *lastSessionId);
+
+// Parses the filename packet and answers it. Returns 0 if the file is available.
+int processClient(ChildContext *child, int dataLen, char *buffer);
+
+// Fills winSize, bufSize, filename and nonce from a flag-8 packet. bufSize is
+// cut down to what the path to the client carries unfragmented. A file of
+// more packets than the compact header numbers gets the wide header, and
+// is refused to a client that didn't offer it. Parity groups are granted
+// to clients that offer HS_OPT_FEC.
+int parseFilenamePdu(ChildContext *child, int dataLen, char *buffer);
+
+// Builds the flag-9 reply into child->ackPayload and sends it.
+int answerHandshake(ChildContext *child);
+
+// Builds the reply without sending it, settling the granted options.
+// Returns 0 for "Ok", -1 for "Not Ok".
+int buildHandshakeAck(ChildContext *child);
+
+// Tells a client the server is full: "Busy" + HS_OPT_RETRY_MS, session 0.
+int sendBusyAck(int socketNum, struct sockaddr_in6 *client, uint32_t retryMs);
+
+int resendHandshakeAck(int socketNum, struct sockaddr_in6 *client, uint32_t sessionId,
+                       const char *ackPayload, int ackLen);
+
+// True when both handshakes come from the same client address and nonce.
+bool sameHandshake(const struct sockaddr_in6 *a, uint32_t nonceA,
+                   const struct sockaddr_in6 *b, uint32_t nonceB);
+
+bool lookupFilename(const char *filename);
+
+void send_data_packet(ChildContext *child, WindowBuffer *wb, uint64_t seq,
+                        bool isEOF, size_t bytesRead);
+
+void send_next_data(ChildContext *child, WindowBuffer *wb, uint64_t *nextSeq,
+                    bool *eofSent, uint64_t *eofSeq, FILE *file);
+
+void retransmit_packets(ChildContext *child, WindowBuffer *wb, uint64_t base, uint64_t nextSeq);
+
+#endif
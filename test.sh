@@ -31,16 +31,18 @@ if [ ! -f "$TEST_DIR/large.dat" ]; then
     echo "Created large test file (~420KB)"
 fi
 
-# Function to start the server
+# Function to start the server (any further arguments are server options)
 start_server() {
     local error_rate=$1
+    shift
+    local server_opts="$*"
     
     # Kill any existing server process
     pkill -f "server $error_rate $SERVER_PORT" 2>/dev/null
     
     # Start server in background
-    echo "Starting server with error rate: $error_rate"
-    ./server $error_rate $SERVER_PORT > "$LOG_DIR/server.log" 2>&1 &
+    echo "Starting server with error rate: $error_rate $server_opts"
+    ./server $error_rate $SERVER_PORT $server_opts > "$LOG_DIR/server.log" 2>&1 &
     
     # Store server PID
     SERVER_PID=$!
@@ -167,6 +169,42 @@ run_multiple_clients() {
     echo "Multiple client test completed"
 }
 
+# Function to time repeated copies of one file and report their goodput
+measure_goodput() {
+    local input_file=$1
+    local runs=$2
+    local test_name=$3
+    local size=$(wc -c < "$TEST_DIR/$input_file")
+    local test_result="PASS"
+    local rebuilt=0
+    local total_ms=0
+    local times=()
+    local log_file="$LOG_DIR/goodput_$(date +%s%N).log"
+
+    echo "-----------------------------------------------------"
+    echo "Test: $test_name ($runs runs)"
+    for i in $(seq 1 $runs); do
+        local start=$(date +%s%N)
+        ./rcopy $TEST_DIR/$input_file $OUTPUT_DIR/goodput_$input_file 64 1000 0 $SERVER_HOST $SERVER_PORT > $log_file 2>&1
+        local run_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+        times+=($run_ms)
+        total_ms=$((total_ms + run_ms))
+        if ! cmp -s "$TEST_DIR/$input_file" "$OUTPUT_DIR/goodput_$input_file"; then
+            test_result="FAIL"
+        fi
+        local count=$(grep -o "rebuilt [0-9]* packets" $log_file | grep -o "[0-9]*")
+        rebuilt=$((rebuilt + ${count:-0}))
+    done
+    [ $total_ms -gt 0 ] || total_ms=1
+
+    # The occasional run stalled on a lost handshake or EOF swamps the
+    # total, so the median run is the steadier number
+    local median_ms=$(printf "%s\n" "${times[@]}" | sort -n | sed -n "$(( (runs + 1) / 2 ))p")
+    echo "$test_name: median $median_ms ms per copy, $((size * runs / total_ms)) KB/s over $total_ms ms," \
+         "$rebuilt packets rebuilt from parity"
+    record_test_result "$test_name" "$test_result"
+}
+
 # Function to display test summary
 display_summary() {
     echo ""
@@ -338,9 +376,52 @@ start_server 0
 run_copy "nonexistent_file.dat" "should_not_exist.dat" 10 1000 0 "" "9: File not found error handling"
 stop_server
 
-# Test 10: Check for any sleep/seek functions
+# Test 10: UDP GSO (-g)
+echo "========================================================"
+echo "TEST CASE 10: UDP GSO (-g)"
+echo "========================================================"
+
+# Test 10.1: Bursts of full-size packets go out as GSO buffers, the short
+# EOF packet ending the last run
+start_server 0 -g
+run_copy "large.dat" "large_gso.dat" 50 1000 0 "" "10.1: GSO bursts"
+stop_server
+
+# Test 10.2: Resends mixed into GSO batches (threads mode batches with errors)
+start_server 0.1 -g -m threads
+run_copy "large.dat" "large_gso_threads.dat" 50 1000 0.1 "" "10.2: GSO with resends (threads)"
+stop_server
+
+# Test 10.3: Fallback: with errors outside threads mode -g is ignored and
+# packets go out one at a time
+start_server 0.1 -g
+run_copy "large.dat" "large_gso_fallback.dat" 50 1000 0.1 "" "10.3: GSO fallback to single sends"
+if grep -q "\-g ignored" "$LOG_DIR/server.log"; then
+    echo "✅ SUCCESS: Server fell back to single sends"
+    record_test_result "10.3: GSO fallback reported" "PASS"
+else
+    echo "❌ FAILURE: Server did not report the fallback"
+    record_test_result "10.3: GSO fallback reported" "FAIL"
+fi
+stop_server
+
+# Test 11: Goodput under loss with and without FEC (-f). The server drops
+# 5% of its packets; the times are what to compare, both must pass
+echo "========================================================"
+echo "TEST CASE 11: FEC goodput under loss"
+echo "========================================================"
+
+start_server 0.05
+measure_goodput "large.dat" 20 "11.1: Goodput without FEC"
+stop_server
+
+start_server 0.05 -f 16:4
+measure_goodput "large.dat" 20 "11.2: Goodput with FEC (-f 16:4)"
+stop_server
+
+# Test 12: Check for any sleep/seek functions
 echo "========================================================"
-echo "TEST CASE 10: Check for prohibited functions"
+echo "TEST CASE 12: Check for prohibited functions"
 echo "========================================================"
 
 check_prohibited_functions
@@ -0,0 +1,571 @@
+// Raw socket I/O for the server's threaded paths.
+// Note: cpe464.h is deliberately not included here, so sendto()/recvfrom()
+// below are the real system calls rather than the library hooks.
+
+#define _GNU_SOURCE     // sendmmsg(), recvmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <netinet/udp.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+
+#include "udpIo.h"
+#include "helperFunctions.h"
+
+// A finished range of zerocopy send numbers, lo..hi inclusive
+typedef struct {
+    uint32_t lo;
+    uint32_t hi;
+} ZcRange;
+
+// Zerocopy bookkeeping for one socket, indexed by fd
+typedef struct {
+    int state;                // 0 not set up, 1 SO_ZEROCOPY on, -1 plain sends
+    uint32_t next;            // number the kernel gives the next zerocopy send
+    uint32_t done;            // every send numbered below this has completed
+    ZcRange *ahead;           // completed ranges beyond done
+    int aheadCount;
+    int aheadCap;
+    uint64_t sends;
+    uint64_t copied;
+} ZeroCopySocket;
+
+static _Thread_local ErrorSim *threadSim = NULL;
+static atomic_bool gsoEnabled = false;   // shared by all sender threads
+static atomic_bool zeroCopyEnabled = false;
+static _Thread_local ZeroCopySocket *zcSockets = NULL;   // sockets are used by one thread
+static _Thread_local int zcCap = 0;
+
+static int gsoSendto(int sock, struct iovec *packets, int count, const struct sockaddr_in6 *dest, int flags);
+static ZeroCopySocket *zcSocket(int sock, bool create);
+static void zcComplete(ZeroCopySocket *zs, int sock, uint32_t lo, uint32_t hi);
+
+void initErrorSim(ErrorSim *sim, double errorRate, int dropFlag, int flipFlag, long seed){
+    sim->error_rate = errorRate;
+    sim->drop_flag = dropFlag;
+    sim->flip_flag = flipFlag;
+    sim->xsubi[0] = 0x330E;
+    sim->xsubi[1] = (unsigned short)seed;
+    sim->xsubi[2] = (unsigned short)(seed >> 16);
+}
+
+void bindErrorSim(ErrorSim *sim){
+    threadSim = sim;
+}
+
+ErrorSim *currentErrorSim(void){
+    return threadSim;
+}
+
+ssize_t simSendto(ErrorSim *sim, int sock, const void *buf, size_t len, const struct sockaddr_in6 *dest){
+    if (sim->error_rate > 0) {
+        if (sim->drop_flag && erand48(sim->xsubi) < sim->error_rate) {
+            return len;
+        }
+        if (sim->flip_flag && erand48(sim->xsubi) < sim->error_rate) {
+            char flipped[MAX_DATA_PDU_SIZE];
+            if (len <= sizeof(flipped)) {
+                memcpy(flipped, buf, len);
+                flipped[(size_t)(len * erand48(sim->xsubi))] ^= 0xFF;
+                return sendto(sock, flipped, len, 0, (const struct sockaddr *)dest, sizeof(*dest));
+            }
+        }
+    }
+    return sendto(sock, buf, len, 0, (const struct sockaddr *)dest, sizeof(*dest));
+}
+
+bool simulateErrors(ErrorSim *sim, uint8_t *packet, size_t len){
+    if (sim->error_rate > 0) {
+        if (sim->drop_flag && erand48(sim->xsubi) < sim->error_rate) {
+            return false;
+        }
+        if (sim->flip_flag && erand48(sim->xsubi) < sim->error_rate) {
+            packet[(size_t)(len * erand48(sim->xsubi))] ^= 0xFF;
+        }
+    }
+    return true;
+}
+
+int batchSendto(ErrorSim *sim, int sock, struct iovec *packets, int count, const struct sockaddr_in6 *dest,
+                bool zerocopy){
+    struct iovec kept[SEND_BATCH_MAX];
+    int keptCount = 0;
+
+    for (int i = 0; i < count && keptCount < SEND_BATCH_MAX; i++) {
+        if (sim == NULL || simulateErrors(sim, packets[i].iov_base, packets[i].iov_len)) {
+            kept[keptCount++] = packets[i];
+        }
+    }
+
+    ZeroCopySocket *zs = zerocopy ? zcSocket(sock, true) : NULL;
+    if (zs && zs->state == 0) {
+        int on = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+            perror("setsockopt SO_ZEROCOPY, copying instead");
+            zs->state = -1;
+        } else {
+            zs->state = 1;
+        }
+    }
+    if (zs && zs->state != 1) {
+        zs = NULL;
+    }
+    int flags = zs ? MSG_ZEROCOPY : 0;
+
+    // Whatever GSO didn't get out goes one datagram per packet
+    int first = 0;
+    if (atomic_load(&gsoEnabled)) {
+        first = gsoSendto(sock, kept, keptCount, dest, flags);
+        if (first < 0) {
+            return -1;
+        }
+    }
+
+    struct mmsghdr msgs[SEND_BATCH_MAX];
+    int n = 0;
+    for (int i = first; i < keptCount; i++) {
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_hdr.msg_name = (void *)dest;
+        msgs[n].msg_hdr.msg_namelen = sizeof(*dest);
+        msgs[n].msg_hdr.msg_iov = &kept[i];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        n++;
+    }
+
+    // sendmmsg() may stop early, e.g. when the socket buffer fills
+    int sent = 0;
+    while (sent < n) {
+        int r = sendmmsg(sock, msgs + sent, n - sent, flags);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && flags) {
+                flags = 0;   // out of pinned-page allowance, copy the rest
+                continue;
+            }
+            if (errno == EMSGSIZE && allowFragmentation(sock)) {
+                continue;
+            }
+            perror("sendmmsg");
+            return -1;
+        }
+        sent += r;
+        if (flags) {
+            zs->next += r;
+            zs->sends += r;
+        }
+    }
+    return 0;
+}
+
+void setZeroCopy(bool enabled){
+    atomic_store(&zeroCopyEnabled, enabled);
+}
+
+bool zeroCopyActive(int sock){
+    if (!atomic_load(&zeroCopyEnabled)) {
+        return false;
+    }
+    ZeroCopySocket *zs = zcSocket(sock, false);
+    return zs == NULL || zs->state >= 0;
+}
+
+bool loopbackAddress(const struct sockaddr_in6 *addr){
+    const uint8_t *a = addr->sin6_addr.s6_addr;
+    return IN6_IS_ADDR_LOOPBACK(&addr->sin6_addr) || (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr) && a[12] == 127);
+}
+
+uint32_t zeroCopyMark(int sock){
+    ZeroCopySocket *zs = zcSocket(sock, false);
+    return zs ? zs->next : 0;
+}
+
+bool zeroCopyDone(int sock, uint32_t mark){
+    ZeroCopySocket *zs = zcSocket(sock, false);
+    return zs == NULL || (int32_t)(zs->done - mark) >= 0;
+}
+
+void reapZeroCopy(int sock){
+    ZeroCopySocket *zs = zcSocket(sock, false);
+    if (zs == NULL || zs->state == 0) {
+        return;
+    }
+
+    while (1) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvmsg MSG_ERRQUEUE");
+            }
+            return;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            bool recvErr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                        || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (!recvErr || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                continue;
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zs->copied += err.ee_data - err.ee_info + 1;
+                if (zs->state == 1) {
+                    printf("Zerocopy sends on socket %d were copied by the kernel, sending plainly\n", sock);
+                    zs->state = -1;
+                }
+            }
+            zcComplete(zs, sock, err.ee_info, err.ee_data);
+        }
+    }
+}
+
+void waitZeroCopy(int sock, uint32_t mark){
+    if (zeroCopyDone(sock, mark)) {
+        return;
+    }
+    uint64_t deadline = getTimeMs() + ZEROCOPY_WAIT_MS;
+    reapZeroCopy(sock);
+    while (!zeroCopyDone(sock, mark)) {
+        uint64_t now = getTimeMs();
+        if (now >= deadline) {
+            fprintf(stderr, "Zerocopy completion overdue on socket %d, reusing the buffer\n", sock);
+            return;
+        }
+        // With no events asked for, poll() still wakes for the error queue
+        struct pollfd pfd = {.fd = sock, .events = 0};
+        poll(&pfd, 1, (int)(deadline - now));
+        reapZeroCopy(sock);
+    }
+}
+
+void printZeroCopyStats(int sock){
+    ZeroCopySocket *zs = zcSocket(sock, false);
+    if (zs == NULL || zs->state == 0) {
+        return;
+    }
+    waitZeroCopy(sock, zs->next);
+    printf("Zerocopy on socket %d: %lu sends, %lu copied by the kernel\n",
+           sock, (unsigned long)zs->sends, (unsigned long)zs->copied);
+}
+
+void closeZeroCopy(int sock){
+    ZeroCopySocket *zs = zcSocket(sock, false);
+    if (zs == NULL || zs->state == 0) {
+        return;
+    }
+    waitZeroCopy(sock, zs->next);
+    free(zs->ahead);
+    memset(zs, 0, sizeof(*zs));
+}
+
+static ZeroCopySocket *zcSocket(int sock, bool create){
+    if (sock < 0 || (sock >= zcCap && !create)) {
+        return NULL;
+    }
+    if (sock >= zcCap) {
+        int cap = zcCap ? zcCap : 64;
+        while (cap <= sock) {
+            cap *= 2;
+        }
+        zcSockets = realloc(zcSockets, cap * sizeof(ZeroCopySocket));
+        if (zcSockets == NULL) {
+            perror("realloc");
+            exit(-1);
+        }
+        memset(zcSockets + zcCap, 0, (cap - zcCap) * sizeof(ZeroCopySocket));
+        zcCap = cap;
+    }
+    return &zcSockets[sock];
+}
+
+// Records that sends lo..hi finished. Completions normally arrive in order;
+// ranges that arrive early wait in ahead[] until the gap before them closes.
+// None may be dropped, or done would stop at it for good, so ahead[] grows;
+// a socket with more than ZEROCOPY_PENDING_MAX of them goes back to plain
+// sends, which bounds it by the zerocopy sends still in flight.
+static void zcComplete(ZeroCopySocket *zs, int sock, uint32_t lo, uint32_t hi){
+    if (lo != zs->done) {
+        for (int i = 0; i < zs->aheadCount; i++) {
+            if (zs->ahead[i].hi + 1 == lo) {
+                zs->ahead[i].hi = hi;
+                return;
+            }
+            if (hi + 1 == zs->ahead[i].lo) {
+                zs->ahead[i].lo = lo;
+                return;
+            }
+        }
+        if (zs->aheadCount == zs->aheadCap) {
+            zs->aheadCap = zs->aheadCap ? zs->aheadCap * 2 : ZEROCOPY_PENDING_MAX;
+            zs->ahead = realloc(zs->ahead, zs->aheadCap * sizeof(ZcRange));
+            if (zs->ahead == NULL) {
+                perror("realloc");
+                exit(-1);
+            }
+        }
+        zs->ahead[zs->aheadCount++] = (ZcRange){lo, hi};
+        if (zs->aheadCount > ZEROCOPY_PENDING_MAX && zs->state == 1) {
+            printf("Zerocopy completions on socket %d are %d ranges out of order, sending plainly\n", sock, zs->aheadCount);
+            zs->state = -1;
+        }
+        return;
+    }
+    zs->done = hi + 1;
+
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int i = 0; i < zs->aheadCount; i++) {
+            if (zs->ahead[i].lo == zs->done) {
+                zs->done = zs->ahead[i].hi + 1;
+                zs->ahead[i] = zs->ahead[--zs->aheadCount];
+                merged = true;
+                break;
+            }
+        }
+    }
+}
+
+bool probeUdpGso(void){
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return false;
+    }
+    int segment = 0;
+    socklen_t len = sizeof(segment);
+    bool supported = getsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+    close(sock);
+    return supported;
+}
+
+void setUdpGso(bool enabled){
+    atomic_store(&gsoEnabled, enabled);
+}
+
+// One message per run of same-size packets, so each run is a single trip
+// through the stack. A shorter packet may end a run (the kernel allows the
+// last segment to be short). Returns how many packets were sent, which is
+// less than count if the kernel refused GSO, or -1 on any other error.
+static int gsoSendto(int sock, struct iovec *packets, int count, const struct sockaddr_in6 *dest, int flags){
+    struct mmsghdr msgs[SEND_BATCH_MAX];
+    char control[SEND_BATCH_MAX][CMSG_SPACE(sizeof(uint16_t))];
+    int firstPacket[SEND_BATCH_MAX + 1];
+    int n = 0;
+    int maxSegments = flags ? GSO_ZEROCOPY_SEGMENTS : GSO_MAX_SEGMENTS;
+
+    for (int i = 0; i < count; ) {
+        size_t segment = packets[i].iov_len;
+        size_t total = segment;
+        int j = i + 1;
+        while (j < count && j - i < maxSegments &&
+               packets[j].iov_len <= segment && total + packets[j].iov_len <= GSO_MAX_BYTES) {
+            total += packets[j].iov_len;
+            if (packets[j++].iov_len < segment) {
+                break;
+            }
+        }
+
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_hdr.msg_name = (void *)dest;
+        msgs[n].msg_hdr.msg_namelen = sizeof(*dest);
+        msgs[n].msg_hdr.msg_iov = &packets[i];
+        msgs[n].msg_hdr.msg_iovlen = j - i;
+        if (j - i > 1) {
+            memset(control[n], 0, sizeof(control[n]));
+            msgs[n].msg_hdr.msg_control = control[n];
+            msgs[n].msg_hdr.msg_controllen = sizeof(control[n]);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segSize = (uint16_t)segment;
+            memcpy(CMSG_DATA(cmsg), &segSize, sizeof(segSize));
+        }
+        firstPacket[n++] = i;
+        i = j;
+    }
+    firstPacket[n] = count;
+
+    int sent = 0;
+    while (sent < n) {
+        int r = sendmmsg(sock, msgs + sent, n - sent, flags);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == ENOBUFS && flags) || errno == EMSGSIZE) {
+                return firstPacket[sent];   // the plain path sends the rest
+            }
+            if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+                fprintf(stderr, "UDP GSO rejected by the kernel (%s), sending packets singly\n", strerror(errno));
+                atomic_store(&gsoEnabled, false);
+                return firstPacket[sent];
+            }
+            perror("sendmmsg (GSO)");
+            return -1;
+        }
+        sent += r;
+        if (flags) {
+            ZeroCopySocket *zs = zcSocket(sock, false);
+            zs->next += r;
+            zs->sends += r;
+        }
+    }
+    return count;
+}
+
+// ----- Path MTU -----
+void setDontFragment(int sock){
+    int v4 = IP_PMTUDISC_DO;    // v4-mapped clients take the IPv4 setting
+    int v6 = IPV6_PMTUDISC_DO;
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &v4, sizeof(v4)) < 0 ||
+        setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v6, sizeof(v6)) < 0) {
+        perror("setsockopt MTU_DISCOVER, packets may be fragmented");
+    }
+}
+
+bool allowFragmentation(int sock){
+    int v6 = 0;
+    socklen_t len = sizeof(v6);
+    if (getsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v6, &len) < 0 || v6 != IPV6_PMTUDISC_DO) {
+        return false;
+    }
+    fprintf(stderr, "Path MTU fell below the session's packets, letting IP fragment them\n");
+    int v4 = IP_PMTUDISC_WANT;
+    v6 = IPV6_PMTUDISC_WANT;
+    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &v4, sizeof(v4));
+    setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v6, sizeof(v6));
+    return true;
+}
+
+// The kernel only reports the path MTU of a connected socket, so this
+// connects a throwaway one; nothing is sent.
+uint32_t pathPayload(const struct sockaddr_in6 *dest){
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return MAX_PAYLOAD;
+    }
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    if (connect(sock, (const struct sockaddr *)dest, sizeof(*dest)) < 0 ||
+        getsockopt(sock, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) < 0) {
+        close(sock);
+        return MAX_PAYLOAD;
+    }
+    close(sock);
+
+    int ipHeader = IN6_IS_ADDR_V4MAPPED(&dest->sin6_addr) ? (int)sizeof(struct iphdr) : (int)sizeof(struct ip6_hdr);
+    int payload = mtu - ipHeader - (int)sizeof(struct udphdr) - (int)HEADER_SIZE;
+    if (payload <= 0) {
+        return MAX_PAYLOAD;
+    }
+    return payload < MAX_BUFFER ? (uint32_t)payload : MAX_BUFFER;
+}
+
+int batchRecvfrom(int sock, struct iovec *buffers, int *lens, int max, struct sockaddr_in6 *srcs){
+    struct mmsghdr msgs[RECV_BATCH_MAX];
+    if (max > RECV_BATCH_MAX) {
+        max = RECV_BATCH_MAX;
+    }
+    for (int i = 0; i < max; i++) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &srcs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(srcs[i]);
+        msgs[i].msg_hdr.msg_iov = &buffers[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n;
+    do {
+        n = recvmmsg(sock, msgs, max, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("recvmmsg");
+        exit(-1);
+    }
+    for (int i = 0; i < n; i++) {
+        lens[i] = msgs[i].msg_len;
+    }
+    return n;
+}
+
+int enableUdpGro(int sock){
+    int on = 1;
+    if (setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        perror("setsockopt UDP_GRO");
+        return -1;
+    }
+    return 0;
+}
+
+int batchRecvGro(int sock, struct iovec *buffers, int *lens, int *segs, int max, struct sockaddr_in6 *srcs){
+    struct mmsghdr msgs[GRO_BATCH_MAX];
+    char control[GRO_BATCH_MAX][CMSG_SPACE(sizeof(int))];
+    if (max > GRO_BATCH_MAX) {
+        max = GRO_BATCH_MAX;
+    }
+    for (int i = 0; i < max; i++) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &srcs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(srcs[i]);
+        msgs[i].msg_hdr.msg_iov = &buffers[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+    int n;
+    do {
+        n = recvmmsg(sock, msgs, max, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("recvmmsg");
+        exit(-1);
+    }
+
+    for (int i = 0; i < n; i++) {
+        lens[i] = msgs[i].msg_len;
+        segs[i] = lens[i];
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment;
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                if (segment > 0) {
+                    segs[i] = segment;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+ssize_t rawRecvfrom(int sock, void *buf, size_t len, int flags, struct sockaddr_in6 *src, socklen_t *srcLen){
+    ssize_t returnValue = recvfrom(sock, buf, len, flags, (struct sockaddr *)src, srcLen);
+    if (returnValue < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("recvfrom: ");
+        exit(-1);
+    }
+    return returnValue;
+}
@@ -0,0 +1,123 @@
+#ifndef UDPIO_H
+#define UDPIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define SEND_BATCH_MAX 64
+#define RECV_BATCH_MAX 32
+#define GSO_MAX_BYTES 65000     // one GSO send must fit a single UDP datagram
+#define GSO_MAX_SEGMENTS 64     // the kernel's UDP_MAX_SEGMENTS
+#define GSO_ZEROCOPY_SEGMENTS 8 // zerocopy: two pages per segment within MAX_SKB_FRAGS
+#define GRO_BUFFER_BYTES 65536  // largest datagram GRO can hand up
+#define GRO_BATCH_MAX 8
+#define ZEROCOPY_WAIT_MS 1000     // longest a buffer waits for its zerocopy completion
+#define ZEROCOPY_PENDING_MAX 16   // out-of-order completion ranges before a socket sends plainly
+
+// Per-owner replacement for the sendtoErr() drop/flip simulation in
+// libcpe464. The library keeps its state in one global packet manager, so
+// threads that must not share state each bind their own ErrorSim instead.
+typedef struct {
+    double error_rate;
+    int drop_flag;
+    int flip_flag;
+    unsigned short xsubi[3];   // erand48() state, private to the owner
+} ErrorSim;
+
+void initErrorSim(ErrorSim *sim, double errorRate, int dropFlag, int flipFlag, long seed);
+
+// Binds sim to the calling thread. While bound, sendPdu()/recvPdu() bypass
+// libcpe464 and use the plain socket calls below. NULL unbinds.
+void bindErrorSim(ErrorSim *sim);
+ErrorSim *currentErrorSim(void);
+
+// Applies the simulator to one outgoing packet: may corrupt it in place.
+// Returns false if it should be dropped instead.
+bool simulateErrors(ErrorSim *sim, uint8_t *packet, size_t len);
+
+// sendto() through the simulator. A dropped packet still reports len bytes sent.
+ssize_t simSendto(ErrorSim *sim, int sock, const void *buf, size_t len, const struct sockaddr_in6 *dest);
+
+// Sends count packets to dest with as few sendmmsg() calls as the kernel
+// allows, using GSO when it is enabled. With sim non-NULL each packet is
+// first dropped or corrupted as simSendto() would, in place. With zerocopy
+// the packets go out with MSG_ZEROCOPY (see below) and must stay untouched
+// until their completion; sim must then be NULL. Returns 0, or -1 if
+// sendmmsg() failed.
+int batchSendto(ErrorSim *sim, int sock, struct iovec *packets, int count, const struct sockaddr_in6 *dest,
+                bool zerocopy);
+
+// ----- MSG_ZEROCOPY -----
+// The kernel numbers every MSG_ZEROCOPY send on a socket, starting at 0,
+// and reports finished ranges of those numbers on the socket's error queue.
+// A buffer sent before zeroCopyMark() returned n may be reused once
+// zeroCopyDone(sock, n). Completions are reaped by reapZeroCopy(), which
+// must run whenever the socket polls with an error (recvPdus() does). A
+// socket whose sends the kernel had to copy anyway goes back to plain
+// sends since zerocopy only costs it there. Loopback always copies, and
+// its receiver is charged for whole pinned pages, so callers check
+// loopbackAddress() and don't try.
+void setZeroCopy(bool enabled);
+bool zeroCopyActive(int sock);
+bool loopbackAddress(const struct sockaddr_in6 *addr);
+uint32_t zeroCopyMark(int sock);
+bool zeroCopyDone(int sock, uint32_t mark);
+void reapZeroCopy(int sock);
+
+// Waits for zeroCopyDone(), at most ZEROCOPY_WAIT_MS. After that the buffer
+// is reused anyway: a packet the kernel reads late fails its checksum at the
+// client and is resent.
+void waitZeroCopy(int sock, uint32_t mark);
+
+// Waits for every send on sock and prints how many the kernel had to copy.
+void printZeroCopyStats(int sock);
+
+// Waits for every send on sock and forgets it, before the socket is closed.
+void closeZeroCopy(int sock);
+
+// UDP generic segmentation offload. While enabled, batchSendto() hands the
+// kernel each run of same-size packets as one buffer with a UDP_SEGMENT
+// cmsg, and the kernel cuts it back into one datagram per packet. The first
+// send the kernel rejects turns it off for good and the rest go out one
+// datagram at a time. probeUdpGso() checks that the kernel knows UDP_SEGMENT.
+bool probeUdpGso(void);
+void setUdpGso(bool enabled);
+
+// Turns on UDP_GRO for sock, after which the kernel may deliver runs of
+// same-size datagrams from one sender as a single coalesced one. Returns 0,
+// or -1 if the kernel doesn't support it.
+int enableUdpGro(int sock);
+
+// batchRecvfrom() for a UDP_GRO socket. Each buffer should be
+// GRO_BUFFER_BYTES long. segs[i] is the segment size the kernel reported
+// for a coalesced datagram, or lens[i] if it arrived as it was sent.
+int batchRecvGro(int sock, struct iovec *buffers, int *lens, int *segs, int max, struct sockaddr_in6 *srcs);
+
+// ----- Path MTU -----
+// Server sockets send with DF set (IP_MTU_DISCOVER and IPV6_MTU_DISCOVER
+// at "do"), so a hop too small for a data packet drops it and reports its
+// MTU back in an ICMP error instead of fragmenting it, and the kernel
+// lowers its path MTU for that client. pathPayload() is the largest
+// payload behind a compact pdu header that the kernel's current path MTU to
+// dest carries in one datagram,
+// which the handshake grants as the session's buffer size. Once a path
+// shrinks below that mid-transfer, sends fail with EMSGSIZE; a session
+// can't renumber its blocks, so allowFragmentation() turns DF back off for
+// the socket and IP fragments from then on.
+void setDontFragment(int sock);
+bool allowFragmentation(int sock);   // false if it was already allowed
+uint32_t pathPayload(const struct sockaddr_in6 *dest);
+
+// Drains up to max queued datagrams with one non-blocking recvmmsg(). Each
+// buffer's length goes in lens. Returns the number received, 0 if nothing
+// was queued.
+int batchRecvfrom(int sock, struct iovec *buffers, int *lens, int max, struct sockaddr_in6 *srcs);
+
+// Plain recvfrom(), exits on error like safeRecvfrom().
+ssize_t rawRecvfrom(int sock, void *buf, size_t len, int flags, struct sockaddr_in6 *src, socklen_t *srcLen);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uringIo.h"
+
+static int uringSetup(unsigned entries, struct io_uring_params *params);
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags);
+
+int initUring(Uring *ring, unsigned entries){
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = uringSetup(entries, &params);
+    if (ring->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap && ring->cqRingSize > ring->sqRingSize) {
+        ring->sqRingSize = ring->cqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        perror("mmap SQ ring");
+        close(ring->fd);
+        return -1;
+    }
+    ring->cqRing = singleMap ? ring->sqRing
+                             : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+        perror("mmap CQ ring");
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap SQEs");
+        if (!singleMap) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->sqSubmitted = ring->sqLocalTail;
+
+    uint8_t *cq = ring->cqRing;
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->cqEntries = params.cq_entries;
+    return 0;
+}
+
+void freeUring(Uring *ring){
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+bool probeUring(void){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = uringSetup(2, &params);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+struct io_uring_sqe *uringSqe(Uring *ring){
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqLocalTail - head >= ring->sqEntries || ring->inFlight >= ring->cqEntries) {
+        return NULL;
+    }
+    unsigned index = ring->sqLocalTail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    ring->inFlight++;
+    return sqe;
+}
+
+void uringPrepRead(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, uint64_t offset, void *userData){
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)(uintptr_t)userData;
+}
+
+void uringPrepSendmsg(struct io_uring_sqe *sqe, int sock, const struct msghdr *msg, void *userData){
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)userData;
+}
+
+int uringSubmit(Uring *ring, unsigned waitFor){
+    unsigned toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+    if (toSubmit == 0 && waitFor == 0) {
+        return 0;
+    }
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+    int r;
+    do {
+        r = uringEnter(ring->fd, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    ring->sqSubmitted += r;
+    return r;
+}
+
+bool uringCompletion(Uring *ring, void **userData, int *res){
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+    *userData = (void *)(uintptr_t)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    ring->inFlight--;
+    return true;
+}
+
+static int uringSetup(unsigned entries, struct io_uring_params *params){
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags){
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
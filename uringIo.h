@@ -0,0 +1,66 @@
+#ifndef URINGIO_H
+#define URINGIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+
+// Minimal io_uring on the raw system calls (no liburing). One ring belongs
+// to one thread: SQEs are filled with uringSqe() and the uringPrep*()
+// helpers, handed to the kernel by uringSubmit(), and their completions are
+// popped with uringCompletion(). The ring fd polls readable while
+// completions are waiting, so it can sit in a poll or epoll set. No more
+// requests are handed out than the completion queue holds, since a
+// completion the kernel had to keep on its overflow list would never be
+// popped here.
+typedef struct {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail;      // SQEs handed out, published on submit
+    unsigned sqSubmitted;      // SQEs the kernel has been told about
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned cqEntries;
+    unsigned inFlight;         // SQEs handed out whose completion hasn't been popped
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+} Uring;
+
+// Sets up a ring with room for entries SQEs. Returns 0, or -1 if the kernel
+// won't give us one (too old, or io_uring disabled).
+int  initUring(Uring *ring, unsigned entries);
+void freeUring(Uring *ring);
+
+// True if io_uring_setup() works here at all.
+bool probeUring(void);
+
+// Next free SQE, zeroed, or NULL if the submission queue is full or the
+// completion queue has no room for another completion.
+struct io_uring_sqe *uringSqe(Uring *ring);
+
+void uringPrepRead(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, uint64_t offset, void *userData);
+void uringPrepSendmsg(struct io_uring_sqe *sqe, int sock, const struct msghdr *msg, void *userData);
+
+// Submits the SQEs filled since the last call and waits for at least
+// waitFor completions. Returns the number submitted, or -1 on error.
+int uringSubmit(Uring *ring, unsigned waitFor);
+
+// Pops one completion. Returns false when the completion queue is empty.
+bool uringCompletion(Uring *ring, void **userData, int *res);
+
+#endif
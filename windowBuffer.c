@@ -1,4 +1,15 @@
 #include "windowBuffer.h"
+
+// Points every pane at its share of the slab, all empty.
+static void carve_panes(pane *panes, uint8_t *slab, uint32_t windowSize, uint32_t bufferSize) {
+    for (uint32_t i = 0; i < windowSize; i++) {
+        panes[i].seq_num = MAX_INT_64; //prevent any issues
+        panes[i].zc_mark = 0;
+        panes[i].headroom = slab + (size_t)i * PANE_BYTES(bufferSize);
+        panes[i].data = panes[i].headroom + PANE_HEADROOM;
+    }
+}
+
 void init_window(WindowBuffer *wb, uint32_t windowSize, uint32_t bufferSize, FILE* input) {
 
     wb->window_size = windowSize;
@@ -8,13 +19,12 @@ void init_window(WindowBuffer *wb, uint32_t windowSize, uint32_t bufferSize, FIL
     wb->upper = windowSize - 1;
     wb->buffer_size = bufferSize;
     wb->panes = (pane *)malloc(windowSize * sizeof(pane)); //alllocate an entire window of memory
-    if (wb->panes == NULL) {
+    wb->slab = (uint8_t *)malloc((size_t)windowSize * PANE_BYTES(bufferSize));
+    if (wb->panes == NULL || wb->slab == NULL) {
         fprintf(stderr, "Error allocating memory for window buffer.\n");
         exit(EXIT_FAILURE);
     }
-    for (uint32_t i = 0; i < windowSize; i++) {
-        wb->panes[i].seq_num = MAX_INT_32; //prevent any issues
-    }
+    carve_panes(wb->panes, wb->slab, windowSize, bufferSize);
 }
 
 int slide_window(WindowBuffer *wb, int length) {
@@ -23,7 +33,35 @@ int slide_window(WindowBuffer *wb, int length) {
     return 0; // Success
 }
 
+int resize_window(WindowBuffer *wb, uint32_t newSize, uint64_t first, uint64_t last) {
+    pane *panes = (pane *)malloc(newSize * sizeof(pane));
+    uint8_t *slab = (uint8_t *)malloc((size_t)newSize * PANE_BYTES(wb->buffer_size));
+    if (panes == NULL || slab == NULL) {
+        free(panes);
+        free(slab);
+        return -1;
+    }
+    carve_panes(panes, slab, newSize, wb->buffer_size);
+    for (uint64_t seq = first; seq < last; seq++) {
+        pane *from = &wb->panes[seq % wb->window_size];
+        pane *to = &panes[seq % newSize];
+        to->seq_num = from->seq_num;
+        to->zc_mark = from->zc_mark;
+        memcpy(to->headroom, from->headroom, PANE_BYTES(wb->buffer_size));
+    }
+
+    free(wb->panes);
+    free(wb->slab);
+    wb->panes = panes;
+    wb->slab = slab;
+    wb->window_size = newSize;
+    wb->upper = wb->lower + newSize - 1;
+    return 0;
+}
+
 void free_window(WindowBuffer *wb) {
     free(wb->panes);
+    free(wb->slab);
     wb->panes = NULL;
+    wb->slab = NULL;
 }
\ No newline at end of file
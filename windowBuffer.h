@@ -6,22 +6,29 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_BUFFER 1400
-#define MAX_INT_32 0xFFFFFFFF
+#define MAX_BUFFER 65000    // largest payload a session can negotiate: one UDP datagram less headers
+#define MAX_INT_64 0xFFFFFFFFFFFFFFFFull
+#define PANE_HEADROOM 15    // sizeof(pdu_wide_header), so a pane can be sent as a whole packet
+
+// Bytes one pane of a window with this buffer size takes, headroom included
+#define PANE_BYTES(bufferSize) (PANE_HEADROOM + (bufferSize))
 
 typedef struct {
-    uint32_t seq_num;   //holds sequence number(likely a global variable to be incremented)
-    uint8_t data[MAX_BUFFER];
+    uint64_t seq_num;   //holds sequence number(likely a global variable to be incremented)
+    uint32_t zc_mark;   // zerocopy: the pane may be rewritten once the kernel is done with this send
+    uint8_t *headroom;  // room for the pdu header when the pane is sent in place, ending where data starts
+    uint8_t *data;      // buffer_size bytes
 } pane;  //heh. pane holds each data from file to be sent.
 
 typedef struct {
     pane *panes;
+    uint8_t *slab;     // every pane's headroom and data, PANE_BYTES(buffer_size) apart
     FILE *data;  //file pointer to data stored on server 
     uint32_t window_size;
     uint32_t buffer_size;
-    uint32_t lower;  // lower edge
+    uint64_t lower;  // lower edge
     uint32_t currIndex;  // current index
-    uint32_t upper;     // upper edge, will 
+    uint64_t upper;     // upper edge, will 
 } WindowBuffer;
 
 void init_window(WindowBuffer *wb, uint32_t windowSize, uint32_t bufferSize, FILE* input);
@@ -29,6 +36,11 @@ void init_window(WindowBuffer *wb, uint32_t windowSize, uint32_t bufferSize, FIL
 // Moves the window forward by specified amount ((sizeof struct) * amount)
 int slide_window(WindowBuffer *wb, int length);
 
+// Reallocates the window to newSize panes of the same buffer size. Panes for sequence numbers
+// [first, last) move to their slot in the new window, so the caller must
+// keep last - first <= newSize. Returns 0 on success, -1 if out of memory.
+int resize_window(WindowBuffer *wb, uint32_t newSize, uint64_t first, uint64_t last);
+
 // Frees allocated memory when done sliding around
 void free_window(WindowBuffer *wb);
 
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "safeUtil.h"
+#include "cpe464.h"
+#include "pollLib.h"
+#include "workerPool.h"
+
+static int  spawnWorker(WorkerPool *pool);
+static void workerLoop(WorkerPool *pool, int channel);
+static int  sendHandoff(int channel, SessionHandoff *handoff, int sessionFd);
+static int  recvHandoff(int channel, SessionHandoff *handoff, int *sessionFd);
+static void removeWorker(WorkerPool *pool, int index);
+static void drainQueue(WorkerPool *pool);
+
+void initWorkerPool(WorkerPool *pool, int min, int max, double errorRate, int listenSocket,
+                    HandshakeCache *handshakes, Admission *admission, void (*runSession)(ChildContext *child)){
+    memset(pool, 0, sizeof(WorkerPool));
+    pool->min = min;
+    pool->max = max;
+    pool->error_rate = errorRate;
+    pool->listenSocket = listenSocket;
+    pool->handshakes = handshakes;
+    pool->admission = admission;
+    pool->runSession = runSession;
+    pool->workers = sCalloc(max, sizeof(PoolWorker));
+
+    for (int i = 0; i < min; i++) {
+        spawnWorker(pool);
+    }
+    printf("Worker pool started: %d workers (min %d, max %d)\n", pool->count, min, max);
+}
+
+int dispatchSession(WorkerPool *pool, ChildContext *child){
+    SessionHandoff handoff;
+    memset(&handoff, 0, sizeof(handoff));
+    handoff.client = child->client;
+    handoff.clientAddrLen = child->clientAddrLen;
+    handoff.sessionId = child->sessionId;
+    memcpy(handoff.filename, child->filename, sizeof(handoff.filename));
+    handoff.winSize = child->winSize;
+    handoff.bufSize = child->bufSize;
+    handoff.sack = child->sack;
+    handoff.ackEvery = child->ackEvery;
+    handoff.ackDelayMs = child->ackDelayMs;
+    handoff.wideSeq = child->wideSeq;
+    handoff.fecGroup = child->fecGroup;
+    handoff.fecParity = child->fecParity;
+    memcpy(handoff.ackPayload, child->ackPayload, child->ackLen);
+    handoff.ackLen = child->ackLen;
+    handoff.admittedBytes = child->admittedBytes;
+    handoff.admittedMem = child->admittedMem;
+
+    // Prefer an idle worker, then grow the pool, then queue.
+    int index = -1;
+    for (int i = 0; i < pool->count; i++) {
+        if (!pool->workers[i].busy) { index = i; break; }
+    }
+    if (index < 0 && pool->count < pool->max && spawnWorker(pool) == 0) {
+        index = pool->count - 1;
+    }
+
+    if (index < 0) {
+        if (pool->queueLen == POOL_QUEUE_SIZE) {
+            fprintf(stderr, "Worker pool queue full, dropping session for %s\n", child->filename);
+            return -1;
+        }
+        int slot = (pool->queueHead + pool->queueLen++) % POOL_QUEUE_SIZE;
+        pool->queue[slot] = handoff;
+        pool->queueFds[slot] = dup(child->socketNum);
+        child->admitted = false;   // the queue entry carries the reservation now
+        printf("All %d workers busy, session queued (%d waiting)\n", pool->count, pool->queueLen);
+        return 0;
+    }
+
+    if (sendHandoff(pool->workers[index].channel, &handoff, child->socketNum) < 0) {
+        return -1;
+    }
+    child->admitted = false;   // the worker holds the reservation now
+    pool->workers[index].busy = true;
+    pool->workers[index].admittedBytes = handoff.admittedBytes;
+    pool->workers[index].admittedMem = handoff.admittedMem;
+    printf("Session for %s handed to worker %d\n", child->filename, pool->workers[index].pid);
+    return 0;
+}
+
+bool isPoolChannel(WorkerPool *pool, int fd){
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->workers[i].channel == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void poolChannelReadable(WorkerPool *pool, int fd){
+    for (int i = 0; i < pool->count; i++) {
+        PoolWorker *w = &pool->workers[i];
+        if (w->channel != fd) {
+            continue;
+        }
+
+        char done;
+        bool exited = read(fd, &done, 1) <= 0;
+        if (w->busy && w->admittedBytes > 0) {
+            releaseReservation(pool->admission, w->admittedBytes, w->admittedMem);
+        }
+        w->admittedBytes = 0;
+        w->admittedMem = 0;
+
+        if (exited) {
+            printf("Worker %d exited\n", w->pid);
+            removeWorker(pool, i);
+        } else {
+            w->busy = false;
+            w->idleSince = getTimeMs();
+        }
+        break;
+    }
+
+    // One replacement per event; if fork keeps failing trimWorkerPool() retries
+    if (pool->count < pool->min) {
+        spawnWorker(pool);
+    }
+    drainQueue(pool);
+}
+
+void trimWorkerPool(WorkerPool *pool){
+    uint64_t now = getTimeMs();
+    int i = 0;
+    while (i < pool->count && pool->count > pool->min) {
+        PoolWorker *w = &pool->workers[i];
+        if (!w->busy && now - w->idleSince >= POOL_IDLE_MS) {
+            printf("Retiring idle worker %d\n", w->pid);
+            removeWorker(pool, i);
+        } else {
+            i++;
+        }
+    }
+    if (pool->count < pool->min && spawnWorker(pool) == 0) {
+        drainQueue(pool);
+    }
+}
+
+static void drainQueue(WorkerPool *pool){
+    for (int i = 0; i < pool->count && pool->queueLen > 0; i++) {
+        PoolWorker *w = &pool->workers[i];
+        if (w->busy) {
+            continue;
+        }
+        int slot = pool->queueHead;
+        if (sendHandoff(w->channel, &pool->queue[slot], pool->queueFds[slot]) == 0) {
+            w->busy = true;
+            w->admittedBytes = pool->queue[slot].admittedBytes;
+            w->admittedMem = pool->queue[slot].admittedMem;
+        } else if (pool->queue[slot].admittedBytes > 0) {
+            releaseReservation(pool->admission, pool->queue[slot].admittedBytes,
+                               pool->queue[slot].admittedMem);
+        }
+        close(pool->queueFds[slot]);
+        pool->queueHead = (pool->queueHead + 1) % POOL_QUEUE_SIZE;
+        pool->queueLen--;
+    }
+}
+
+// Closing the channel tells the worker to exit once it is idle.
+static void removeWorker(WorkerPool *pool, int index){
+    PoolWorker *w = &pool->workers[index];
+    removeFromPollSet(w->channel);
+    close(w->channel);
+    waitpid(w->pid, NULL, 0);
+    pool->workers[index] = pool->workers[--pool->count];
+}
+
+static int spawnWorker(WorkerPool *pool){
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Worker: drop everything that belongs to the parent
+        close(sv[0]);
+        close(pool->listenSocket);
+        closeHandshakeFds(pool->handshakes);
+        for (int i = 0; i < pool->count; i++) {
+            close(pool->workers[i].channel);
+        }
+        for (int i = 0; i < pool->queueLen; i++) {
+            close(pool->queueFds[(pool->queueHead + i) % POOL_QUEUE_SIZE]);
+        }
+        workerLoop(pool, sv[1]);
+        exit(0);
+    }
+
+    close(sv[1]);
+    PoolWorker *w = &pool->workers[pool->count++];
+    w->pid = pid;
+    w->channel = sv[0];
+    w->busy = false;
+    w->idleSince = getTimeMs();
+    addToPollSet(w->channel);
+    return 0;
+}
+
+static void workerLoop(WorkerPool *pool, int channel){
+    // Set up once per worker rather than once per session
+    sendErr_init(pool->error_rate, DROP_ON, FLIP_ON, DEBUG_ON, RSEED_ON);
+    setupPollSet();
+    printf("----- WORKER %d: READY -----\n", getpid());
+
+    while (1) {
+        SessionHandoff handoff;
+        int sessionFd = -1;
+        if (recvHandoff(channel, &handoff, &sessionFd) <= 0) {
+            break;
+        }
+
+        ChildContext child;
+        memset(&child, 0, sizeof(child));
+        child.socketNum = sessionFd;
+        child.ownsSocket = true;
+        child.sessionId = handoff.sessionId;
+        child.error_rate = pool->error_rate;
+        child.client = handoff.client;
+        child.clientAddrLen = handoff.clientAddrLen;
+        memcpy(child.filename, handoff.filename, sizeof(child.filename));
+        child.winSize = handoff.winSize;
+        child.bufSize = handoff.bufSize;
+        child.sack = handoff.sack;
+        child.ackEvery = handoff.ackEvery;
+        child.ackDelayMs = handoff.ackDelayMs;
+        child.wideSeq = handoff.wideSeq;
+        child.fecGroup = handoff.fecGroup;
+        child.fecParity = handoff.fecParity;
+        memcpy(child.ackPayload, handoff.ackPayload, handoff.ackLen);
+        child.ackLen = handoff.ackLen;
+        child.ackOk = true;
+
+        addToPollSet(sessionFd);
+        if (resendHandshakeAck(sessionFd, &child.client, child.sessionId, child.ackPayload, child.ackLen) < 0) {
+            fprintf(stderr, "ERROR: Failed to send Ok\n");
+        } else if (beginTransfer(&child) == 0) {
+            pool->runSession(&child);
+        }
+        removeFromPollSet(sessionFd);
+        finishTransfer(&child);
+
+        char done = 1;
+        if (write(channel, &done, 1) < 0) {
+            break;
+        }
+    }
+    printf("----- WORKER %d: EXIT -----\n", getpid());
+    close(channel);
+}
+
+static int sendHandoff(int channel, SessionHandoff *handoff, int sessionFd){
+    struct iovec iov = {.iov_base = handoff, .iov_len = sizeof(SessionHandoff)};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sessionFd, sizeof(int));
+
+    if (sendmsg(channel, &msg, 0) < 0) {
+        perror("sendmsg handoff");
+        return -1;
+    }
+    return 0;
+}
+
+static int recvHandoff(int channel, SessionHandoff *handoff, int *sessionFd){
+    struct iovec iov = {.iov_base = handoff, .iov_len = sizeof(SessionHandoff)};
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(channel, &msg, 0);
+    if (n <= 0) {
+        return (int)n;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(SessionHandoff) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Malformed session handoff\n");
+        return -1;
+    }
+    memcpy(sessionFd, CMSG_DATA(cmsg), sizeof(int));
+    return (int)n;
+}
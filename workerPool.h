@@ -0,0 +1,87 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "session.h"
+#include "admission.h"
+#include "handshakeCache.h"
+
+#define POOL_DEFAULT_MIN 2
+#define POOL_DEFAULT_MAX 16
+#define POOL_IDLE_MS 5000          // idle time before a worker above min is retired
+#define POOL_QUEUE_SIZE 64
+
+// Session handed from the parent to a worker over the UNIX channel. The
+// session socket itself travels alongside as SCM_RIGHTS ancillary data.
+typedef struct {
+    struct sockaddr_in6 client;
+    socklen_t clientAddrLen;
+    uint32_t sessionId;
+    char filename[MAX_FILENAME + 1];
+    uint32_t winSize;
+    uint32_t bufSize;
+    bool sack;
+    uint16_t ackEvery;
+    uint16_t ackDelayMs;
+    bool wideSeq;
+    uint16_t fecGroup;
+    uint8_t fecParity;
+    char ackPayload[MAX_ACK_PAYLOAD];   // the "Ok", sent by the worker ahead of its data
+    int ackLen;
+    uint64_t admittedBytes;   // reservation returned when the worker finishes
+    uint64_t admittedMem;
+} SessionHandoff;
+
+typedef struct {
+    pid_t pid;
+    int channel;        // parent end of the UNIX socketpair
+    bool busy;
+    uint64_t admittedBytes;   // held by the session it is running
+    uint64_t admittedMem;
+    uint64_t idleSince;
+} PoolWorker;
+
+typedef struct {
+    PoolWorker *workers;
+    int count;
+    int min;
+    int max;
+    double error_rate;
+    int listenSocket;                 // closed in workers after fork
+    HandshakeCache *handshakes;       // parent's session socket copies, likewise
+    Admission *admission;             // released as workers finish sessions
+    void (*runSession)(ChildContext *child);
+
+    // Acknowledged sessions waiting for a free worker when the pool is at max
+    SessionHandoff queue[POOL_QUEUE_SIZE];
+    int queueFds[POOL_QUEUE_SIZE];
+    int queueHead;
+    int queueLen;
+} WorkerPool;
+
+// Forks min workers. runSession is called in a worker for every session it is
+// handed, after the transfer has been started.
+void initWorkerPool(WorkerPool *pool, int min, int max, double errorRate, int listenSocket,
+                    HandshakeCache *handshakes, Admission *admission, void (*runSession)(ChildContext *child));
+
+// Hands a session whose "Ok" has been built but not sent to an idle
+// worker, growing the pool up to max or queueing when it is full. The
+// worker sends the "Ok" right before the transfer starts, so the client
+// never gets one for a session nobody serves. The caller keeps ownership
+// of child->socketNum. On success the pool takes over the session's
+// admission reservation. Returns 0 on success.
+int dispatchSession(WorkerPool *pool, ChildContext *child);
+
+// Returns true if fd is one of the pool's worker channels.
+bool isPoolChannel(WorkerPool *pool, int fd);
+
+// A worker channel is readable: the worker finished a session or exited.
+void poolChannelReadable(WorkerPool *pool, int fd);
+
+// Retires idle workers above min, and replaces one missing below min (a
+// fork that failed earlier), handing it any queued session.
+void trimWorkerPool(WorkerPool *pool);
+
+#endif